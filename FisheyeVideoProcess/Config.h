@@ -31,6 +31,9 @@ using namespace cv;
 #endif
 //#define SHOW_IMAGE
 //#define TRY_CATCH
+//#define TWO_PHASE_RENDER	// Calibrate on frames sampled over the clip first, then render every frame with the calibration
+//#define LOAD_CALIBRATION RESOURCE_PATH "calibration.bin"	// Skip registration with the calibration of a former run on the same rig
+//#define SAVE_CALIBRATION OUTPUT_PATH "calibration.bin"		// Save the calibration in use after processing, to be loaded by later runs
 
 const double M_PI = PI;
 const double ERR = 1e-7;
@@ -17,6 +17,7 @@ inline std::string getruntimeHashCode() {
 #ifdef NEED_LOG
 std::stringstream sslog;
 FILE *fplog;
+cv::Mutex mtxlog;
 #endif
 
 LocalStitchingInfoGroup LSIG;
@@ -32,7 +33,17 @@ int main(int argc, char ** args) {
 		RESOURCE_PATH + (std::string)"back.mp4"
 	};
 	processor.setPaths(oriSrc,sizeof(oriSrc)/sizeof(std::string),OUTPUT_PATH + (std::string)"test.avi"); //TOSOLVE: ouput must be avi format??
+#ifdef TWO_PHASE_RENDER
+	processor.processTwoPhase(OUTPUT_PATH + (std::string)"calibration.bin", 3, 0);
+#else
+#ifdef LOAD_CALIBRATION
+	processor.loadCalibration(LOAD_CALIBRATION);
+#endif
 	processor.process(3,0);
+#ifdef SAVE_CALIBRATION
+	processor.saveCalibration(SAVE_CALIBRATION);
+#endif
+#endif
 #elif defined(RUN_TEST)
 	TestCase tc;
 	tc.test5();
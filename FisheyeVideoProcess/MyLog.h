@@ -5,6 +5,7 @@
 extern std::string runtimeHashCode;
 extern std::stringstream sslog;
 extern FILE *fplog;
+extern cv::Mutex mtxlog;	// sslog and fplog are shared, logging may come from stitching stages running concurrently
 
 /* LOG to screen and files */
 
@@ -17,18 +18,22 @@ extern FILE *fplog;
 		fclose(fplog);}
 
 	#define LOG_ERR(msg)          {           \
+		cv::AutoLock _loglock(mtxlog);\
 		std::cout << "[Error] " << msg << std::endl;\
 		WRITE_LOG(msg<<std::endl,(LOG_PATH+runtimeHashCode+(std::string)".err"));}
 
 	#define LOG_WARN(msg)          {           \
+		cv::AutoLock _loglock(mtxlog);\
 		std::cout << "[Warning] " << msg << std::endl;\
 		WRITE_LOG(msg<<std::endl,(LOG_PATH+runtimeHashCode+(std::string)".warn"));}
 
 	#define LOG_MESS(msg)          {          \
+		cv::AutoLock _loglock(mtxlog);\
 		std::cout << "[Message] " << msg << std::endl;\
 		WRITE_LOG(msg<<std::endl,(LOG_PATH+runtimeHashCode+(std::string)".mess"));}
 
 	#define LOG_MARK(msg)         {            \
+		cv::AutoLock _loglock(mtxlog);\
 		std::cout << ">>>>> " << msg << std::endl;\
 		WRITE_LOG(">>>>> " << msg<<std::endl,(LOG_PATH+runtimeHashCode+(std::string)".mess"));\
 		WRITE_LOG(">>>>> " << msg<<std::endl,(LOG_PATH+runtimeHashCode+(std::string)".warn"));\
@@ -205,18 +205,25 @@ bool FileUtil::readMatBinary(std::ifstream& ifs, cv::Mat& in_mat) {
 	}
 	
 	int rows, cols, type;
-	ifs.read((char*)(&rows), sizeof(int));
+	if(!ifs.read((char*)(&rows), sizeof(int))){
+		return false;
+	}
 	if(rows==0){
+		in_mat.release();
 		return true;
 	}
-	ifs.read((char*)(&cols), sizeof(int));
-	ifs.read((char*)(&type), sizeof(int));
+	if(!ifs.read((char*)(&cols), sizeof(int)) || !ifs.read((char*)(&type), sizeof(int))){
+		return false;
+	}
+	// Check the header before allocating, since a corrupted one may ask for any size
+	if(rows < 0 || cols <= 0 || type != CV_MAT_TYPE(type) || CV_MAT_DEPTH(type) > CV_64F
+		|| static_cast<double>(rows) * cols * CV_ELEM_SIZE(type) > FU_MAT_MAX_BYTES){
+		return false;
+	}
 
 	in_mat.release();
 	in_mat.create(rows, cols, type);
-	ifs.read((char*)(in_mat.data), in_mat.elemSize() * in_mat.total());
-
-	return true;
+	return !!ifs.read((char*)(in_mat.data), in_mat.elemSize() * in_mat.total());
 }
 
 
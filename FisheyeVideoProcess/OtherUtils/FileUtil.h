@@ -16,6 +16,7 @@ enum FILE_STORAGE_TYPE {
 class FileUtil {
 #define FU_COMPRESS_FLAG 
 #define FU_RAROBJ ".\\rar.exe "
+#define FU_MAT_MAX_BYTES (1<<30)	/* Upper bound of a Mat read by readMatBinary, beyond which the stream is taken as corrupted */
 private:
 	static std::vector<std::string> waitToDeleteBuff;
 	static bool findOrCreateDir(const char * path);
@@ -23,14 +24,13 @@ private:
 	static std::string getFileNameByFidx(int fidx, std::string elseInfo="",std::string extension=getExtension(NORMAL));
 	static std::string getMatNameByMatidx(int fidx, int midx);
 
-	// referred from https://github.com/takmin/BinaryCvMat
-	static bool writeMatBinary(std::ofstream& ofs, const cv::Mat& out_mat);
-	static bool readMatBinary(std::ifstream& ifs, cv::Mat& in_mat);
-	
-
 	static std::string getExtension(FILE_STORAGE_TYPE fst);
 public:
 	static FILE_STORAGE_TYPE FILE_STORAGE_MAT_DEFAULT;
+	// referred from https://github.com/takmin/BinaryCvMat. Raw data is written, so Mats must be continuous
+	static bool writeMatBinary(std::ofstream& ofs, const cv::Mat& out_mat);
+	/* Return false if the stream ends early or the header is not of a valid Mat */
+	static bool readMatBinary(std::ifstream& ifs, cv::Mat& in_mat);
 	static bool SaveMatBinary(const std::string& filename, const cv::Mat& output);
 	static bool LoadMatBinary(const std::string& filename, cv::Mat& output);
 	static bool findOrCreateAllDirsNeeded();
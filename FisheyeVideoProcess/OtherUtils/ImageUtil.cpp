@@ -0,0 +1,120 @@
+#include "ImageUtil.h"
+#if CV_SSE2
+	#include <emmintrin.h>
+#endif
+
+/* d = s*(1+amount) - b*amount, or s where |s-b| < thres. Same rounding as the former MatExpr version */
+static void usmRow(const uchar *s, const uchar *b, uchar *d, int n, float amount, int thres) {
+	int x = 0;
+#if CV_SSE2
+	// 16 bytes per step
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 ks = _mm_set1_ps(1.f + amount), kb = _mm_set1_ps(-amount);
+	const __m128i vthres = _mm_set1_epi8(static_cast<char>(max(thres - 1, 0)));
+	for (; x <= n - 16; x += 16) {
+		__m128i vs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + x));
+		__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+		__m128i res[2];
+		for (int h = 0; h < 2; ++h) {
+			__m128i s16 = h ? _mm_unpackhi_epi8(vs, zero) : _mm_unpacklo_epi8(vs, zero);
+			__m128i b16 = h ? _mm_unpackhi_epi8(vb, zero) : _mm_unpacklo_epi8(vb, zero);
+			__m128 lo = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(s16, zero)), ks),
+				_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(b16, zero)), kb));
+			__m128 hi = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(s16, zero)), ks),
+				_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(b16, zero)), kb));
+			res[h] = _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+		}
+		__m128i vd = _mm_packus_epi16(res[0], res[1]);
+		if (thres > 0) {
+			// Low contrast pixels are kept, where |s-b| <= thres-1
+			__m128i absdiff = _mm_or_si128(_mm_subs_epu8(vs, vb), _mm_subs_epu8(vb, vs));
+			__m128i keep = _mm_cmpeq_epi8(_mm_subs_epu8(absdiff, vthres), zero);
+			vd = _mm_or_si128(_mm_and_si128(keep, vs), _mm_andnot_si128(keep, vd));
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(d + x), vd);
+	}
+#endif
+	for (; x < n; ++x)
+		d[x] = abs(s[x] - b[x]) < thres ? s[x] : saturate_cast<uchar>(s[x] * (1.f + amount) - b[x] * amount);
+}
+
+/* Detail of luma added to every channel of a pixel, which sharpens luma and keeps chroma */
+static void usmLumaRow(const uchar *s, const uchar *l, const uchar *b, uchar *d, int n, int cn, float amount, int thres) {
+	int x = 0;
+#if CV_SSE2
+	if (cn == 3) {
+		// 8 pixels (24 bytes) per step, the delta of each pixel is spread over its channels
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 vamount = _mm_set1_ps(amount);
+		const __m128i vthres = _mm_set1_epi16(static_cast<short>(min(thres, SHRT_MAX)));
+		short t[8];
+		for (; x <= n - 8; x += 8, s += 24, d += 24) {
+			__m128i l16 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(l + x)), zero);
+			__m128i b16 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + x)), zero);
+			__m128i diff = _mm_sub_epi16(l16, b16);
+			__m128 lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(diff, diff), 16)), vamount);
+			__m128 hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(diff, diff), 16)), vamount);
+			__m128i delta = _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+			// Low contrast pixels are kept, where |diff| < thres
+			__m128i absdiff = _mm_max_epi16(diff, _mm_sub_epi16(zero, diff));
+			delta = _mm_andnot_si128(_mm_cmplt_epi16(absdiff, vthres), delta);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(t), delta);
+
+			__m128i vs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+			__m128i vs2 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(s + 16));
+			__m128i r0 = _mm_adds_epi16(_mm_unpacklo_epi8(vs, zero), _mm_set_epi16(t[2],t[2],t[1],t[1],t[1],t[0],t[0],t[0]));
+			__m128i r1 = _mm_adds_epi16(_mm_unpackhi_epi8(vs, zero), _mm_set_epi16(t[5],t[4],t[4],t[4],t[3],t[3],t[3],t[2]));
+			__m128i r2 = _mm_adds_epi16(_mm_unpacklo_epi8(vs2, zero), _mm_set_epi16(t[7],t[7],t[7],t[6],t[6],t[6],t[5],t[5]));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(d), _mm_packus_epi16(r0, r1));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(d + 16), _mm_packus_epi16(r2, r2));
+		}
+	}
+#endif
+	for (; x < n; ++x, s += cn, d += cn) {
+		int diff = l[x] - b[x];
+		int delta = abs(diff) < thres ? 0 : cvRound(diff * amount);
+		for (int c = 0; c < cn; ++c) d[c] = saturate_cast<uchar>(s[c] + delta);
+	}
+}
+
+/* 
+	Tiles of USM_TILE_ROWS rows. Each tile is blurred and then sharpened while it is still in cache.
+	Tiles are blurred as part of the whole image, since filtering a ROI reads the pixels around it
+*/
+class USMTiles : public ParallelLoopBody {
+public:
+	USMTiles(const Mat &_src, const Mat &_luma, Mat &_dst, float _amount, int _thres, double _sigma)
+		:src(_src), luma(_luma), dst(_dst), amount(_amount), thres(_thres), sigma(_sigma) {}
+	void operator()(const Range &range) const {
+		Mat blur;
+		const Mat &base = luma.empty() ? src : luma;
+		for (int t = range.start; t < range.end; ++t) {
+			int r0 = t * USM_TILE_ROWS, r1 = min(r0 + USM_TILE_ROWS, src.rows);
+			GaussianBlur(base.rowRange(r0, r1), blur, Size(), sigma, sigma);
+			for (int y = r0; y < r1; ++y) {
+				if (luma.empty())
+					usmRow(src.ptr<uchar>(y), blur.ptr<uchar>(y - r0), dst.ptr<uchar>(y), src.cols * src.channels(), amount, thres);
+				else
+					usmLumaRow(src.ptr<uchar>(y), luma.ptr<uchar>(y), blur.ptr<uchar>(y - r0), dst.ptr<uchar>(y),
+						src.cols, src.channels(), amount, thres);
+			}
+		}
+	}
+private:
+	const Mat &src, &luma;
+	Mat &dst;
+	float amount;
+	int thres;
+	double sigma;
+};
+
+void ImageUtil::USM(const Mat &src, Mat &dst, bool isLumaOnly, double amount, int thres, double sigma) {
+	CV_Assert(src.depth() == CV_8U);
+	Mat luma;
+	if (isLumaOnly && src.channels() == 3) cvtColor(src, luma, CV_BGR2GRAY);
+	// Always a new Mat, since tiles read rows around them in src
+	Mat out(src.size(), src.type());
+	int tileCnt = (src.rows + USM_TILE_ROWS - 1) / USM_TILE_ROWS;
+	parallel_for_(Range(0, tileCnt), USMTiles(src, luma, out, static_cast<float>(amount), thres, sigma));
+	dst = out;
+}
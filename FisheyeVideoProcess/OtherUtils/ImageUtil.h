@@ -2,19 +2,12 @@
 #include "..\Config.h"
 class ImageUtil {
 public:
-	/* USM sharpening process */
-	static void USM(Mat &src, Mat &dst) {
-		Mat blur, tmp2; 
-		double amount=1.0;
-		int thres=0;
-		double sigma=3;
-
-		GaussianBlur(src,blur,Size(),sigma, sigma);
-		Mat lowContratsMask = abs(src-blur)<thres;
-		tmp2 = src*(1+amount)+blur*(-amount);
-		src.copyTo(tmp2, lowContratsMask);
-		dst = tmp2;
-	}
+	#define USM_TILE_ROWS 32	/* Rows of a USM tile, small enough for the tile and its blur to stay in cache */
+	/*
+		USM sharpening process of 8-bit images, with blur, difference, threshold and output fused tile by tile.
+		isLumaOnly: Blur luma only and add its detail to every channel, at about a third of the cost
+	*/
+	static void USM(const Mat &src, Mat &dst, bool isLumaOnly = false, double amount = 1.0, int thres = 0, double sigma = 3);
 
 	/* Laplace enhancement process */
 	static void LaplaceEnhannce(Mat &src, Mat &dst) {
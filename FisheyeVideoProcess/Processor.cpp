@@ -9,8 +9,12 @@ Processor::Processor(LocalStitchingInfoGroup *_pLSIG) {
 	stitchingUtil = StitchingUtil();
 	pLSIG = _pLSIG;
 	curStitchingIdx = 0;
+	keyframeIdx = -1;
+	regMs = composeMs = 0;
 	inputFisheyeResize = INPUT_FISHEYE_RESIZE;
 	dstPanoSize = OUTPUT_PANO_SIZE;
+	// Output resizing is folded into single-pass composing, if enabled
+	stitchingUtil.osParam.outputSz = dstPanoSize;
 }
 
 Processor::~Processor() {
@@ -45,6 +49,8 @@ void Processor::setPaths(std::string inputPaths[], int inputCnt, std::string out
 		outputPath, CV_FOURCC('D', 'I', 'V', 'X'),
 		fps = vCapture[0].get(CV_CAP_PROP_FPS), dstPanoSize);
 
+	qualityGovernor.reset(stitchingUtil.osParam, PANO_QUALITY_GOVERNED ? fps : 0);
+
 	std::cout << "[BASIC INFO]" << std::endl;
 	std::cout << "INPUT: (FPS=" << fps << ")" <<  std::endl;
 	for (int i=0; i<inputCnt; ++i) std::cout << "\t" << inputPaths[i] << std::endl;
@@ -75,22 +81,53 @@ bool Processor::panoStitch(std::vector<Mat> &srcs, int frameIdx) {
 	stitchingUtil.stitchingPolicy = sp;
 	stitchingUtil.stitchingType = sType;
 
+	regMs = 0;
+	if (!fixedSIG.empty()) {
+		// Frames come in order and are composed right away, so no window of registrations or waiting frames
+		Mat dst;
+		int64 t = getTickCount();
+		stitchingUtil.doStitch(srcs, dst, fixedSIG, sp, sType);
+		panoRefine(dst, dst);
+		composeMs = (getTickCount() - t) * 1000.0 / getTickFrequency();
+		pLSIG->addToStitchedBuff(frameIdx, dst);
+		LOG_MARK("Done stitching " << frameIdx << " frame.");
+		persistPano();
+		curStitchingIdx = frameIdx + 1;
+		return true;
+	}
+
 	pLSIG->addToWaitingBuff(frameIdx, srcs);
 	std::vector<Mat> vmat, modifiedSrcs(srcs);
 	//ImageUtil::batchOperation(modifiedSrcs, modifiedSrcs, &ImageUtil::equalizeHistBGR);
-	Mat dummy, tmpDst;
+	Mat tmpDst;
 	int leftIdx, rightIdx;
 	calculateWinSz(curStitchingIdx, leftIdx, rightIdx);
 #ifdef TRY_CATCH
 	try {
 #endif
-		stitchingUtil.osParam.isRealStitching = false;
 		if (!pLSIG->cover(leftIdx, rightIdx)) {
-			sInfoGOUT = stitchingUtil.doStitch(
-					modifiedSrcs, dummy, 
-					sInfoGIN,
-					sp,
-					sType);
+			// Registration only runs on frames likely to change the calibration
+			std::vector<Mat> thumbs = StitchingUtil::getOverlapThumbs(modifiedSrcs);
+			double motion = keyframeSIG.empty() ? DBL_MAX : StitchingUtil::overlapThumbsDiff(thumbs, keyframeThumbs);
+			if (motion > REG_MOTION_THRESH || frameIdx - keyframeIdx >= REG_MAX_KEYFRAME_GAP) {
+				// Bundle adjustment starts from the calibration in use, or else the last registered one
+				stitchingUtil.setWarmStart(pLSIG->getPreSuccessSIG().empty() ? keyframeSIG : pLSIG->getPreSuccessSIG());
+				int64 t = getTickCount();
+				sInfoGOUT = stitchingUtil.doEstimate(
+						modifiedSrcs,
+						sInfoGIN,
+						sp,
+						sType);
+				regMs = (getTickCount() - t) * 1000.0 / getTickFrequency();
+				if (StitchingInfo::isSuccess(sInfoGOUT)) {
+					keyframeIdx = frameIdx;
+					keyframeSIG = sInfoGOUT;
+					keyframeThumbs = thumbs;
+				}
+			} else {
+				LOG_MESS("Reuse registration of frame " << keyframeIdx << ", motion score " << motion);
+				sInfoGOUT = keyframeSIG;
+			}
 			pLSIG->push_back(frameIdx,sInfoGOUT);
 		}
 
@@ -109,18 +146,24 @@ bool Processor::panoStitch(std::vector<Mat> &srcs, int frameIdx) {
 		return false;
 	} else {
 		std::vector<int> selFrame;
-		stitchingUtil.osParam.isRealStitching = true;
+		// Frames waiting for the window are emitted in a burst, so composing is measured per frame
+		double ttlComposeMs = 0;
+		int emittedCnt = 0;
 		do {
+			int64 t = getTickCount();
 			bool b = pLSIG->getFromWaitingBuff(curStitchingIdx, vmat);
 			assert(b);
-			sInfoGIN = pLSIG->getAver(leftIdx, rightIdx, selFrame, stitchingUtil);
+			// Reference, so that compose caches (e.g. seams) live across frames
+			StitchingInfoGroup &sInfoGAver = pLSIG->getAver(leftIdx, rightIdx, selFrame, stitchingUtil);
 			LOG_MESS("Stitching "<< curStitchingIdx << " frame using " <<vec2str(selFrame) << "frames.");
 			stitchingUtil.doStitch(
 				vmat, tmpDst, 
-				sInfoGIN,
+				sInfoGAver,
 				sp,
 				sType);
 			panoRefine(tmpDst, tmpDst);
+			ttlComposeMs += (getTickCount() - t) * 1000.0 / getTickFrequency();
+			++emittedCnt;
 			pLSIG->addToStitchedBuff(curStitchingIdx, tmpDst);
 			LOG_MARK("Done stitching " << curStitchingIdx << " frame.");
 			persistPano();
@@ -128,74 +171,120 @@ bool Processor::panoStitch(std::vector<Mat> &srcs, int frameIdx) {
 		} while(curStitchingIdx<ttlFrmsCnt
 			&& pLSIG->cover(leftIdx, rightIdx)
 			&& pLSIG->isExistInWaitingBuff(curStitchingIdx));
+		composeMs = ttlComposeMs / emittedCnt;
 		return true;
 	}
 }
 
+bool Processor::loadCalibration(const std::string &fname) {
+	StitchingInfoGroup sInfoG;
+	if (!StitchingInfo::loadSIG(fname, sInfoG)) {
+		LOG_WARN("No calibration loaded from " << fname << ", frames will be registered.");
+		return false;
+	}
+	if (!StitchingInfo::isSuccess(sInfoG)) {
+		LOG_ERR("Calibration of " << fname << " is not a successful one, ignored.");
+		return false;
+	}
+	fixedSIG = sInfoG;
+	LOG_MARK("Calibration loaded from " << fname << ", registration is skipped.");
+	return true;
+}
+
+bool Processor::saveCalibration(const std::string &fname) const {
+	const StitchingInfoGroup &sInfoG = !fixedSIG.empty() ? fixedSIG
+		: !pLSIG->getPreSuccessSIG().empty() ? pLSIG->getPreSuccessSIG() : keyframeSIG;
+	if (sInfoG.empty()) {
+		LOG_WARN("No calibration to save.");
+		return false;
+	}
+	if (!StitchingInfo::saveSIG(fname, sInfoG)) return false;
+	LOG_MARK("Calibration saved to " << fname);
+	return true;
+}
+
 void Processor::panoRefine(Mat &srcImage, Mat &dstImage) {
-	Mat tmp, tmp2;
-	tmp = srcImage.clone();
-	// USM
-	ImageUtil::resize(tmp, tmp, dstPanoSize,0,0);
-	ImageUtil::USM(tmp,tmp);
-	//ImageUtil::LaplaceEnhannce(tmp,tmp);
-	dstImage = tmp.clone();
+	// Single-pass composing delivers dstPanoSize already, only panoramas composed stage by stage are resized
+	Mat tmp = srcImage;
+	if (tmp.size() != dstPanoSize) ImageUtil::resize(srcImage, tmp, dstPanoSize,0,0);
+	// USM, whose result is a new Mat, so srcImage is never written
+	ImageUtil::USM(tmp,dstImage,PANO_USM_LUMA_ONLY);
+	//ImageUtil::LaplaceEnhannce(dstImage,dstImage);
 }
 
-void Processor::process(int maxSecondsCnt, int startFrame) {
-	std::vector<Mat> srcFrms(camCnt);
-	std::vector<Mat> dstFrms(camCnt);
-	ttlFrmsCnt = fps*(maxSecondsCnt)+startFrame;
-	int fIndex = 0;
-	while (fIndex < startFrame) {
+void Processor::skipFrames(int frameCnt) {
+	for (int fIndex = 0; fIndex < frameCnt; ++fIndex) {
 		Mat tmp;
 		for (int i=0; i<camCnt; ++i) {
 			vCapture[i] >> tmp;
 		}
-		fIndex++;
 	}
+}
 
-	while (fIndex < ttlFrmsCnt) {
-		// frame by frame
-		LOG_MARK("Processing " << fIndex  << "/" << ttlFrmsCnt-1 << " frame ...");
-#ifdef TRY_CATCH
-		try {
-#endif
-			std::vector<Mat> tmpFrms(camCnt);
-			Mat dstImage;
+void Processor::seekFrame(int frameIdx) {
+	for (int i=0; i<camCnt; ++i) vCapture[i].set(CV_CAP_PROP_POS_FRAMES, frameIdx);
+}
+
+void Processor::readFrames(std::vector<Mat> &dstFrms) {
+	std::vector<Mat> srcFrms(camCnt);
+	std::vector<Mat> tmpFrms(camCnt);
 
-			for (int i=0; i<camCnt; ++i) {
-				vCapture[i] >> tmpFrms[i];
-				if (tmpFrms[i].empty()) break;
-				preProcess(tmpFrms[i], tmpFrms[i]);
+	for (int i=0; i<camCnt; ++i) {
+		vCapture[i] >> tmpFrms[i];
+		if (tmpFrms[i].empty()) break;
+		preProcess(tmpFrms[i], tmpFrms[i]);
 		
-				/* Restrict to square frame */
-				srcFrms[i] = tmpFrms[i](
-					/* row */
-					Range(centerOfCircleBeforeResz.y-radiusOfCircle, centerOfCircleBeforeResz.y+radiusOfCircle),
-					/* col */
-					Range(centerOfCircleBeforeResz.x-radiusOfCircle, centerOfCircleBeforeResz.x+radiusOfCircle))
-					.clone();	// must use clone()
+		/* Restrict to square frame */
+		srcFrms[i] = tmpFrms[i](
+			/* row */
+			Range(centerOfCircleBeforeResz.y-radiusOfCircle, centerOfCircleBeforeResz.y+radiusOfCircle),
+			/* col */
+			Range(centerOfCircleBeforeResz.x-radiusOfCircle, centerOfCircleBeforeResz.x+radiusOfCircle))
+			.clone();	// must use clone()
 		
 			
-				dstFrms[i].create(srcFrms[i].rows, srcFrms[i].cols, srcFrms[i].type());
-			}
+		dstFrms[i].create(srcFrms[i].rows, srcFrms[i].cols, srcFrms[i].type());
+	}
 
-			// Hardcode: Use 1st to set centerOfCircleAfterResz
-			static bool isSetCenter = false;
-			if (!isSetCenter) {
-				centerOfCircleAfterResz.x = srcFrms[0].cols/2;
-				centerOfCircleAfterResz.y = srcFrms[0].rows/2;
-				isSetCenter = true;
-			}
-			std::cout << "\tCorrecting ..." <<std::endl;
-			for (int i=0; i<camCnt; ++i) {
-				/*blackenOutsideRegion(srcFrms[i]);*/
-				fisheyeCorrect(srcFrms[i], dstFrms[i]);
+	// Hardcode: Use 1st to set centerOfCircleAfterResz
+	static bool isSetCenter = false;
+	if (!isSetCenter) {
+		centerOfCircleAfterResz.x = srcFrms[0].cols/2;
+		centerOfCircleAfterResz.y = srcFrms[0].rows/2;
+		isSetCenter = true;
+	}
+	std::cout << "\tCorrecting ..." <<std::endl;
+	for (int i=0; i<camCnt; ++i) {
+		/*blackenOutsideRegion(srcFrms[i]);*/
+		fisheyeCorrect(srcFrms[i], dstFrms[i]);
 				
-			}
+	}
+}
+
+void Processor::process(int maxSecondsCnt, int startFrame) {
+	std::vector<Mat> dstFrms(camCnt);
+	ttlFrmsCnt = fps*(maxSecondsCnt)+startFrame;
+	skipFrames(startFrame);
+	int fIndex = startFrame;
+	governedRegParam = stitchingUtil.osParam;
+
+	while (fIndex < ttlFrmsCnt) {
+		// frame by frame
+		LOG_MARK("Processing " << fIndex  << "/" << ttlFrmsCnt-1 << " frame ...");
+#ifdef TRY_CATCH
+		try {
+#endif
+			readFrames(dstFrms);
 			std::cout << "\tStitching ..." <<std::endl;
+			// Windows of LocalStitchingInfoGroup start every LSIG_WINDOW_SIZE frames, the detector only switches there
+			if (fIndex % LSIG_WINDOW_SIZE == 0) stitchingUtil.osParam.setFeaturesTierOf(governedRegParam);
 			panoStitch(dstFrms, fIndex);
+			OpenCVStitchParam osp = stitchingUtil.osParam;
+			if (qualityGovernor.update(regMs + composeMs, osp)) {
+				governedRegParam = osp;
+				osp.setFeaturesTierOf(stitchingUtil.osParam);
+				stitchingUtil.osParam = osp;
+			}
 #ifdef TRY_CATCH
 		} catch (cv::Exception e) {
 			
@@ -211,6 +300,193 @@ void Processor::process(int maxSecondsCnt, int startFrame) {
 	persistPano(true);	//final flush
 }
 
+bool Processor::calibrate(const std::string &calibFile, int maxSecondsCnt, int startFrame, int sampleCnt) {
+	StitchingPolicy sp = StitchingPolicy::STITCH_DOUBLE_SIDE;
+	StitchingType sType = StitchingType::OPENCV_SELF_DEV;
+	stitchingUtil.stitchingPolicy = sp;
+	stitchingUtil.stitchingType = sType;
+
+	// Frame count of the clip is unknown (not positive) for some inputs, then only maxSecondsCnt bounds it
+	double frameCnt = double(fps) * maxSecondsCnt, clipFrameCnt = vCapture[0].get(CV_CAP_PROP_FRAME_COUNT);
+	if (clipFrameCnt > 0) frameCnt = min(frameCnt, clipFrameCnt - startFrame);
+	if (frameCnt < 1) {
+		LOG_ERR("No frame to calibrate on.");
+		return false;
+	}
+	sampleCnt = max(1, min(sampleCnt, int(frameCnt)));
+	// Samples are indexed by their order, since candidates of a LocalStitchingInfoGroup are consecutive
+	LocalStitchingInfoGroup calibLSIG(sampleCnt);
+	StitchingInfoGroup preSIG;
+	int successCnt = 0;
+	for (int k = 0; k < sampleCnt; ++k) {
+		int fIndex = startFrame + int((k + 0.5) * frameCnt / sampleCnt);
+		LOG_MARK("Calibrating on " << fIndex << " frame (" << k+1 << "/" << sampleCnt << ") ...");
+		std::vector<Mat> dstFrms(camCnt);
+		seekFrame(fIndex);
+		readFrames(dstFrms);
+		calibLSIG.addToWaitingBuff(k, dstFrms);
+
+		StitchingInfoGroup sInfoGIN;
+		// The rig is fixed, so bundle adjustment starts from cameras of the former successful sample
+		stitchingUtil.setWarmStart(preSIG);
+		StitchingInfoGroup sInfoGOUT = stitchingUtil.doEstimate(dstFrms, sInfoGIN, sp, sType);
+		if (StitchingInfo::isSuccess(sInfoGOUT)) {
+			preSIG = sInfoGOUT;
+			++successCnt;
+		}
+		calibLSIG.push_back(k, sInfoGOUT);
+	}
+	stitchingUtil.setWarmStart(StitchingInfoGroup());
+	if (successCnt == 0) {
+		LOG_ERR("Calibration fails on all " << sampleCnt << " samples.");
+		return false;
+	}
+
+	std::vector<int> selFrame;
+	StitchingInfoGroup &sInfoG = calibLSIG.getAver(0, sampleCnt, selFrame, stitchingUtil);
+	if (!StitchingInfo::isSuccess(sInfoG)) {
+		LOG_ERR("Calibration fails on selected samples " << vec2str(selFrame));
+		return false;
+	}
+	LOG_MARK("Calibrated by samples " << vec2str(selFrame) << " of " << successCnt << " successful ones.");
+	return StitchingInfo::saveSIG(calibFile, sInfoG);
+}
+
+void Processor::processTwoPhase(const std::string &calibFile, int maxSecondsCnt, int startFrame) {
+	if (!calibrate(calibFile, maxSecondsCnt, startFrame)) return;
+	// Rendering reads the calibration back, the same as a production run with the file
+	if (!loadCalibration(calibFile)) return;
+	seekFrame(0);
+	process(maxSecondsCnt, startFrame);
+}
+
+void Processor::benchmarkRegistration(int maxSecondsCnt, int startFrame) {
+	// Frames are corrected once, then registered from scratch by each tier
+	std::vector<std::vector<Mat>> frames;
+	skipFrames(startFrame);
+	for (int fIndex = 0; fIndex < fps*maxSecondsCnt; ++fIndex) {
+		std::vector<Mat> dstFrms(camCnt);
+		readFrames(dstFrms);
+		frames.push_back(dstFrms);
+	}
+
+	const char *tierNames[] = {"SIFT", "AKAZE", "ORB"};
+	OpenCVStitchParam osParam = stitchingUtil.osParam;
+	for (int tier = FEATURES_SIFT; tier <= FEATURES_ORB; ++tier) {
+		stitchingUtil.osParam.setFeaturesTier(static_cast<FeaturesTier>(tier));
+		stitchingUtil.osParam.isWarmStart = false;
+		int successCnt = 0;
+		double ttlSeconds = 0;
+		for (int fIndex = 0; fIndex < frames.size(); ++fIndex) {
+			StitchingInfoGroup sInfoGIN;
+			int64 t = getTickCount();
+			StitchingInfoGroup sInfoGOUT = stitchingUtil.doEstimate(
+				frames[fIndex], sInfoGIN, StitchingPolicy::STITCH_DOUBLE_SIDE, StitchingType::OPENCV_SELF_DEV);
+			ttlSeconds += (getTickCount() - t) / getTickFrequency();
+			if (!sInfoGOUT.empty() && StitchingInfo::isSuccess(sInfoGOUT)) ++successCnt;
+		}
+		LOG_MARK("Registration tier " << tierNames[tier] << " (match_conf " << stitchingUtil.osParam.match_conf << "): " << ttlSeconds * 1000 / max(1, int(frames.size()))
+			<< " ms/frame, success " << successCnt << "/" << frames.size());
+	}
+	stitchingUtil.osParam = osParam;
+}
+
+void Processor::benchmarkSeams(int maxSecondsCnt, int startFrame) {
+	std::vector<std::vector<Mat>> frames;
+	skipFrames(startFrame);
+	for (int fIndex = 0; fIndex < fps*maxSecondsCnt; ++fIndex) {
+		std::vector<Mat> dstFrms(camCnt);
+		readFrames(dstFrms);
+		frames.push_back(dstFrms);
+	}
+
+	// One calibration for all frames, so that seams of the same geometry are followed across frames
+	StitchingInfoGroup sInfoGIN;
+	StitchingInfoGroup calibration = stitchingUtil.doEstimate(
+		frames[0], sInfoGIN, StitchingPolicy::STITCH_DOUBLE_SIDE, StitchingType::OPENCV_SELF_DEV);
+	if (!StitchingInfo::isSuccess(calibration)) {
+		LOG_ERR("Seam benchmark: registration of the first frame fails.");
+		return;
+	}
+
+	const char *seamNames[] = {"graph cut", "temporal DP"};
+	OpenCVStitchParam osParam = stitchingUtil.osParam;
+	// Stage by stage, since the single-pass compositor never finds seams
+	stitchingUtil.osParam.isSinglePassCompose = false;
+	stitchingUtil.osParam.isSeamStats = true;
+	for (int type = SEAM_GRAPH_CUT; type <= SEAM_TEMPORAL_DP; ++type) {
+		stitchingUtil.osParam.seamFinderType = type;
+		stitchingUtil.resetSeamStats();
+		StitchingInfoGroup sInfoG = calibration;
+		double ttlSeconds = 0;
+		for (int fIndex = 0; fIndex < frames.size(); ++fIndex) {
+			Mat dst;
+			int64 t = getTickCount();
+			stitchingUtil.doStitch(frames[fIndex], dst, sInfoG, StitchingPolicy::STITCH_DOUBLE_SIDE, StitchingType::OPENCV_SELF_DEV);
+			ttlSeconds += (getTickCount() - t) / getTickFrequency();
+		}
+		StitchingUtil::SeamStats stats = stitchingUtil.getSeamStats();
+		LOG_MARK("Seam finder " << seamNames[type] << ": " << ttlSeconds * 1000 / max(1, int(frames.size())) << " ms/frame, "
+			<< stats.findCnt << " finds of " << stats.ttlMs / max(1, stats.findCnt) << " ms, seam cost "
+			<< stats.ttlCost / max(1, stats.findCnt) << ", flicker " << stats.ttlFlicker / max(1, stats.refindCnt));
+	}
+	stitchingUtil.osParam = osParam;
+}
+
+void Processor::checkSinglePass(int maxSecondsCnt, int startFrame) {
+	std::vector<std::vector<Mat>> frames;
+	skipFrames(startFrame);
+	for (int fIndex = 0; fIndex < fps*maxSecondsCnt; ++fIndex) {
+		std::vector<Mat> dstFrms(camCnt);
+		readFrames(dstFrms);
+		frames.push_back(dstFrms);
+	}
+
+	StitchingInfoGroup sInfoGIN;
+	StitchingInfoGroup calibration = stitchingUtil.doEstimate(
+		frames[0], sInfoGIN, StitchingPolicy::STITCH_DOUBLE_SIDE, StitchingType::OPENCV_SELF_DEV);
+	if (!StitchingInfo::isSuccess(calibration)) {
+		LOG_ERR("Single-pass check: registration of the first frame fails.");
+		return;
+	}
+
+	OpenCVStitchParam osParam = stitchingUtil.osParam;
+	// Both at the size of the final stage, so that panoramas are compared pixel by pixel
+	stitchingUtil.osParam.outputSz = Size();
+	// Each way keeps its own compose caches, the single-pass one captures its layers on the first frame
+	StitchingInfoGroup sInfoGStaged = calibration, sInfoGSingle = calibration;
+	double ttlStagedSeconds = 0, ttlSingleSeconds = 0, ttlDiff = 0, maxDiff = 0;
+	int comparedCnt = 0;
+	for (int fIndex = 0; fIndex < frames.size(); ++fIndex) {
+		Mat dstStaged, dstSingle;
+		stitchingUtil.osParam.isSinglePassCompose = false;
+		int64 t = getTickCount();
+		stitchingUtil.doStitch(frames[fIndex], dstStaged, sInfoGStaged, StitchingPolicy::STITCH_DOUBLE_SIDE, StitchingType::OPENCV_SELF_DEV);
+		ttlStagedSeconds += (getTickCount() - t) / getTickFrequency();
+		stitchingUtil.osParam.isSinglePassCompose = true;
+		t = getTickCount();
+		stitchingUtil.doStitch(frames[fIndex], dstSingle, sInfoGSingle, StitchingPolicy::STITCH_DOUBLE_SIDE, StitchingType::OPENCV_SELF_DEV);
+		ttlSingleSeconds += (getTickCount() - t) / getTickFrequency();
+
+		if (dstStaged.empty() || dstStaged.size() != dstSingle.size() || dstStaged.type() != dstSingle.type()) {
+			LOG_WARN("Single-pass check: frame " << fIndex << " mismatches, " << dstStaged.size() << " vs " << dstSingle.size());
+			continue;
+		}
+		Mat diffImg;
+		absdiff(dstStaged, dstSingle, diffImg);
+		Scalar d = mean(diffImg);
+		double diff = (d[0] + d[1] + d[2]) / 3;
+		LOG_MESS("Single-pass check: frame " << fIndex << ", mean abs diff " << diff);
+		ttlDiff += diff;
+		maxDiff = max(maxDiff, diff);
+		++comparedCnt;
+	}
+	LOG_MARK("Single-pass check: stage by stage " << ttlStagedSeconds * 1000 / max(1, int(frames.size())) << " ms/frame, single pass "
+		<< ttlSingleSeconds * 1000 / max(1, int(frames.size())) << " ms/frame, mean abs diff " << ttlDiff / max(1, comparedCnt)
+		<< " (max " << maxDiff << ") of " << comparedCnt << "/" << frames.size() << " frames");
+	stitchingUtil.osParam = osParam;
+}
+
 void Processor::persistPano(bool isFlush) {
 	if (!pLSIG->isStitchedBuffFull() && !isFlush) return; 
 	auto buf = pLSIG->getStitchedBuff();
@@ -7,6 +7,11 @@
 
 #define OUTPUT_PANO_SIZE Size(2880,1440)
 #define INPUT_FISHEYE_RESIZE Size(1440,1440)
+#define REG_MOTION_THRESH 6.0		/* Overlap motion score (mean abs luma diff, 0-255) to trigger registration */
+#define REG_MAX_KEYFRAME_GAP 30		/* Frames between two forced registrations */
+#define PANO_USM_LUMA_ONLY false	/* Sharpen luma only in panoRefine, at about a third of the cost, which also keeps chroma unsharpened */
+#define PANO_QUALITY_GOVERNED false	/* Degrade stitching quality to keep up with the input frame rate. Only for live input, offline jobs keep full quality */
+#define CALIB_SAMPLE_CNT 10			/* Frames sampled evenly across the clip by calibrate() */
 class Processor {
 #define camCnt 2
 private:
@@ -26,9 +31,22 @@ private:
 	/* Main Utils */
 	CorrectingUtil correctingUtil;
 	StitchingUtil stitchingUtil;
+	/* Adjusts stitchingUtil.osParam by the latency of each frame */
+	QualityGovernor qualityGovernor;
+	/* Registration params of the governed level, taken at the next window boundary so that candidates of a window share a detector */
+	OpenCVStitchParam governedRegParam;
+	/* Latency of the latest panoStitch by stage: registration of its frame, and composing per frame it emits (kept if none) */
+	double regMs, composeMs;
 
 	/* Pointer of <class LSIG> */
 	LocalStitchingInfoGroup *pLSIG;
+
+	/* Latest successfully registered frame, reused by frames with little motion in overlaps */
+	int keyframeIdx;
+	StitchingInfoGroup keyframeSIG;
+	std::vector<Mat> keyframeThumbs;
+	/* Calibration of a former run by loadCalibration(), used for every frame instead of registration. Empty if none */
+	StitchingInfoGroup fixedSIG;
 	
 	/* Detect the region of interest of fisheye input */
 	void findFisheyeCircleRegion(Mat &);
@@ -38,6 +56,12 @@ private:
 	void fisheyeCorrect(Mat &src, Mat &dst);
 	/* Apply some pre-process to input */
 	void preProcess(Mat &src, Mat &dst);
+	/* Read and drop frames of all cams */
+	void skipFrames(int frameCnt);
+	/* Move all cams to the given frame */
+	void seekFrame(int frameIdx);
+	/* Read next frames of all cams, pre-processed and corrected */
+	void readFrames(std::vector<Mat> &dstFrms);
 	/* Stitch */
 	bool panoStitch(std::vector<Mat> &srcs, int frameIdx);
 	/* Apply some refinement to pano */
@@ -52,6 +76,23 @@ public:
 	~Processor();
 	/* Set input/output path inpfomation and some initialization */
 	void setPaths(std::string inputPaths[], int inputCnt, std::string outputPath);
+	/* Load a calibration file of the rig, so that frames are composed from the first one without registration */
+	bool loadCalibration(const std::string &fname);
+	/* Save the calibration in use to a file, for later runs on the same rig */
+	bool saveCalibration(const std::string &fname) const;
 	/* The whole process flow */
 	void process(int maxSecCnt = INT_MAX, int startSecond = 0);
+	/*
+		Calibration phase: register sampleCnt frames spread over the clip, pick the calibration from them
+		the same way as <class LocalStitchingInfoGroup> does for a window, and save it to calibFile
+	*/
+	bool calibrate(const std::string &calibFile, int maxSecCnt = INT_MAX, int startFrame = 0, int sampleCnt = CALIB_SAMPLE_CNT);
+	/* Calibrate, then render every frame with the calibration file in one stream, without waiting buffers */
+	void processTwoPhase(const std::string &calibFile, int maxSecCnt = INT_MAX, int startFrame = 0);
+	/* Registration time and success rate of each FeaturesTier on the input clip */
+	void benchmarkRegistration(int maxSecCnt, int startFrame = 0);
+	/* Seam finding time, visibility and flicker of each SeamFinderType on the input clip */
+	void benchmarkSeams(int maxSecCnt, int startFrame = 0);
+	/* Time and mean abs difference of single-pass composing against stage-by-stage composing on the input clip */
+	void checkSinglePass(int maxSecCnt, int startFrame = 0);
 };
\ No newline at end of file
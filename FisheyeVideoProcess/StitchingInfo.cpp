@@ -8,9 +8,23 @@
 void StitchingInfo::clear() {
 	imgCnt = 0;
 	ranges.clear();
+	cropRect = Rect();
 	cameras.clear();
 	resultRois.clear();
 	pltHelpers.clear();
+	seamMasks.clear();
+	seamCorners.clear();
+	seamRefImages.clear();
+	seamPaths.clear();
+	composeMasks.clear();
+	composeImgBuffs.clear();
+	composeWarpedBuffs.clear();
+	gainMaps.clear();
+	gainMapsTarget.clear();
+	gainFrameCnt = 0;
+	panoMaps.clear();
+	panoCompositor.release();
+	cropCache = CropCache();
 }
 StitchingInfo::StitchingInfo(const StitchingInfo &sinfo){
 		imgCnt = sinfo.imgCnt, nonBlackRatio = sinfo.nonBlackRatio;
@@ -18,11 +32,25 @@ StitchingInfo::StitchingInfo(const StitchingInfo &sinfo){
 		resizeSz = sinfo.resizeSz;
 		maskRatio = sinfo.maskRatio;
 		ranges.assign(sinfo.ranges.begin(), sinfo.ranges.end());
+		cropRect = sinfo.cropRect;
 		cameras.assign(sinfo.cameras.begin(), sinfo.cameras.end());
 		projData = sinfo.projData.clone();
 		resultRois.assign(sinfo.resultRois.begin(), sinfo.resultRois.end());
 		pltHelpers.assign(sinfo.pltHelpers.begin(), sinfo.pltHelpers.end());
 		features.assign(sinfo.features.begin(), sinfo.features.end());
+		seamMasks.assign(sinfo.seamMasks.begin(), sinfo.seamMasks.end());
+		seamCorners.assign(sinfo.seamCorners.begin(), sinfo.seamCorners.end());
+		seamRefImages.assign(sinfo.seamRefImages.begin(), sinfo.seamRefImages.end());
+		seamPaths = sinfo.seamPaths;
+		composeMasks.assign(sinfo.composeMasks.begin(), sinfo.composeMasks.end());
+		composeImgBuffs.clear();
+		composeWarpedBuffs.clear();
+		gainMaps.assign(sinfo.gainMaps.begin(), sinfo.gainMaps.end());
+		gainMapsTarget.assign(sinfo.gainMapsTarget.begin(), sinfo.gainMapsTarget.end());
+		gainFrameCnt = sinfo.gainFrameCnt;
+		panoMaps = sinfo.panoMaps;
+		panoCompositor = sinfo.panoCompositor;
+		cropCache = sinfo.cropCache;
 }
 
 StitchingInfo &StitchingInfo::operator = (const StitchingInfo &sinfo) {
@@ -32,11 +60,25 @@ StitchingInfo &StitchingInfo::operator = (const StitchingInfo &sinfo) {
 		resizeSz = sinfo.resizeSz;
 		maskRatio = sinfo.maskRatio;
 		ranges.assign(sinfo.ranges.begin(), sinfo.ranges.end());
+		cropRect = sinfo.cropRect;
 		cameras.assign(sinfo.cameras.begin(), sinfo.cameras.end());
 		projData = sinfo.projData.clone();
 		resultRois.assign(sinfo.resultRois.begin(), sinfo.resultRois.end());
 		pltHelpers.assign(sinfo.pltHelpers.begin(), sinfo.pltHelpers.end());
 		features.assign(sinfo.features.begin(), sinfo.features.end());
+		seamMasks.assign(sinfo.seamMasks.begin(), sinfo.seamMasks.end());
+		seamCorners.assign(sinfo.seamCorners.begin(), sinfo.seamCorners.end());
+		seamRefImages.assign(sinfo.seamRefImages.begin(), sinfo.seamRefImages.end());
+		seamPaths = sinfo.seamPaths;
+		composeMasks.assign(sinfo.composeMasks.begin(), sinfo.composeMasks.end());
+		composeImgBuffs.clear();
+		composeWarpedBuffs.clear();
+		gainMaps.assign(sinfo.gainMaps.begin(), sinfo.gainMaps.end());
+		gainMapsTarget.assign(sinfo.gainMapsTarget.begin(), sinfo.gainMapsTarget.end());
+		gainFrameCnt = sinfo.gainFrameCnt;
+		panoMaps = sinfo.panoMaps;
+		panoCompositor = sinfo.panoCompositor;
+		cropCache = sinfo.cropCache;
 		return *this;
 }
 
@@ -138,7 +180,7 @@ void LocalStitchingInfoGroup::push_back(int fidx, StitchingInfoGroup& g) {
 	groups.addCandidate(fidx, g);
 }
 
-StitchingInfoGroup LocalStitchingInfoGroup::getAver(int head, int tail, std::vector<int> &selectedFrameIdx, StitchingUtil &stitchingUtil) {
+StitchingInfoGroup& LocalStitchingInfoGroup::getAver(int head, int tail, std::vector<int> &selectedFrameIdx, StitchingUtil &stitchingUtil) {
 	std::vector<std::pair<int,double>> tmp = groups.getBestIdx(head, tail);
 	int r = tmp.size()-1;
 	for (;r>=0 && tmp[r].second == 0;--r);
@@ -186,13 +228,10 @@ StitchingInfoGroup LocalStitchingInfoGroup::getAver(int head, int tail, std::vec
 		StitchingInfoGroup ret(GET_GROUP(0).size());
 		std::vector<StitchingInfoGroup*> SIGs;
 		for (int i=0; i<r; ++i) SIGs.push_back(&GET_GROUP(i));
-		StitchingInfo::getAverageSIG(SIGs, ret);
+		StitchingInfo::getAverageSIG(SIGs, ret, stitchingUtil.osParam.match_conf);
 
 		// Adjust the PLT for StitchingInfoGroup
-		bool b = stitchingUtil.osParam.isRealStitching;
-		stitchingUtil.osParam.isRealStitching = false;
 		bool retOK = adjustPltForLSIG(ret, selectedFrameIdx, stitchingUtil);
-		stitchingUtil.osParam.isRealStitching = b;
 
 		if (retOK) {
 			return preSuccessSIG=ret;
@@ -311,15 +350,14 @@ bool LocalStitchingInfoGroup::adjustPltForLSIG(StitchingInfoGroup &group, const
 			resultRoisUsedFrameBase = tmp;
 			resultRoisUsedFrameCur = resultRoisUsedFrameBase;
 			// calc resultRois
-			Mat dummydst;
 			std::vector<Mat> dummysrcs;//(group[0].imgCnt,ImageUtil::createDummyMatRGB(group[0].resizeSz, group[0].srcType));
 			getFromWaitingBuff(v[0],dummysrcs);
 			StitchingInfoGroup out;
 #ifdef TRY_CATCH
 			try {
 #endif
-				out = stitchingUtil.doStitch(
-						dummysrcs, dummydst, 
+				out = stitchingUtil.doEstimate(
+						dummysrcs,
 						group,
 						stitchingUtil.stitchingPolicy,
 						stitchingUtil.stitchingType);
@@ -349,15 +387,14 @@ bool LocalStitchingInfoGroup::adjustPltForLSIG(StitchingInfoGroup &group, const
 				vec2str(std::vector<int>(resultRoisUsedFrameCur.begin(), resultRoisUsedFrameCur.end())) \
 				<< " to" << vec2str(v));
 			resultRoisUsedFrameCur = tmp;
-			Mat dummydst;
 			std::vector<Mat> dummysrcs;//(group[0].imgCnt,ImageUtil::createDummyMatRGB(group[0].resizeSz, group[0].srcType));
 			getFromWaitingBuff(v[0],dummysrcs);
 			StitchingInfoGroup out;
 #ifdef TRY_CATCH
 			try {
 #endif
-				out = stitchingUtil.doStitch(
-						dummysrcs, dummydst, 
+				out = stitchingUtil.doEstimate(
+						dummysrcs,
 						group,
 						stitchingUtil.stitchingPolicy,
 						stitchingUtil.stitchingType);
@@ -444,7 +481,7 @@ void LocalStitchingInfoGroup::collectGarbage(int fidx) {
 #endif
 }
 
-void StitchingInfo::getAverageSIG(const std::vector<StitchingInfoGroup*> &pSIGs, StitchingInfoGroup &ret) {
+void StitchingInfo::getAverageSIG(const std::vector<StitchingInfoGroup*> &pSIGs, StitchingInfoGroup &ret, float matchConf) {
 	int r = pSIGs.size();
 	if (r == 1) {
 		ret.assign((*pSIGs[0]).begin(),(*pSIGs[0]).end()) ;
@@ -481,7 +518,7 @@ void StitchingInfo::getAverageSIG(const std::vector<StitchingInfoGroup*> &pSIGs,
 		ret[j].maskRatio = (*pSIGs[0])[j].maskRatio;
 		ret[j].cameras = std::vector<cv::detail::CameraParams>((*pSIGs[0])[j].cameras.size());
 
-		supp::MergeableBestOf2NearestMatcher matcher(false, OpenCVStitchParam().match_conf);
+		supp::MergeableBestOf2NearestMatcher matcher(false, matchConf);
 		matcher.setOnlyFindMatched(true);
 		std::vector<supp::matchesTuple> mtps(r);
 		std::vector<std::vector<cv::detail::MatchesInfo>> pairMatches(r);
@@ -550,3 +587,111 @@ void StitchingInfo::getAverageSIG(const std::vector<StitchingInfoGroup*> &pSIGs,
 		}
 	}
 }
+
+/* Calibration file layout: magic, version and group size, then fields of each StitchingInfo in a fixed order */
+#define CALIB_FILE_MAGIC "FVPCALIB"
+#define CALIB_FILE_VERSION 1
+#define CALIB_FILE_MAX_CNT 1024	/* Upper bound of any element count, beyond which a file is taken as corrupted */
+
+template<typename T>
+static inline void writePod(std::ofstream &ofs, const T &v) {ofs.write((const char*)&v, sizeof(T));}
+template<typename T>
+static inline bool readPod(std::ifstream &ifs, T &v) {return !!ifs.read((char*)&v, sizeof(T));}
+static inline bool readCnt(std::ifstream &ifs, int &cnt) {return readPod(ifs, cnt) && cnt >= 0 && cnt <= CALIB_FILE_MAX_CNT;}
+
+bool StitchingInfo::saveSIG(const std::string &fname, const StitchingInfoGroup &group) {
+	std::ofstream ofs(fname, std::ios::binary);
+	if (!ofs.is_open()) {
+		LOG_ERR("Fail to open calibration file " << fname);
+		return false;
+	}
+	ofs.write(CALIB_FILE_MAGIC, strlen(CALIB_FILE_MAGIC));
+	writePod(ofs, int(CALIB_FILE_VERSION));
+	writePod(ofs, int(group.size()));
+	for (auto &sInfo:group) {
+		writePod(ofs, sInfo.imgCnt);
+		writePod(ofs, sInfo.srcType);
+		writePod(ofs, sInfo.nonBlackRatio);
+		writePod(ofs, sInfo.resizeSz);
+		writePod(ofs, sInfo.maskRatio.first);
+		writePod(ofs, sInfo.maskRatio.second);
+		writePod(ofs, int(sInfo.ranges.size()));
+		for (auto &r:sInfo.ranges) writePod(ofs, r);
+		writePod(ofs, sInfo.cropRect);
+		writePod(ofs, int(sInfo.cameras.size()));
+		for (auto &cam:sInfo.cameras) {
+			writePod(ofs, cam.focal);
+			writePod(ofs, cam.aspect);
+			writePod(ofs, cam.ppx);
+			writePod(ofs, cam.ppy);
+			FileUtil::writeMatBinary(ofs, cam.R.isContinuous() ? cam.R : cam.R.clone());
+			FileUtil::writeMatBinary(ofs, cam.t.isContinuous() ? cam.t : cam.t.clone());
+		}
+		FileUtil::writeMatBinary(ofs, sInfo.projData.isContinuous() ? sInfo.projData : sInfo.projData.clone());
+		writePod(ofs, int(sInfo.resultRois.size()));
+		for (auto &rr:sInfo.resultRois) {
+			writePod(ofs, rr.srcSz);
+			writePod(ofs, rr.roi);
+			writePod(ofs, rr.imgIdx);
+		}
+		writePod(ofs, int(sInfo.pltHelpers.size()));
+		for (auto &plt:sInfo.pltHelpers) {
+			writePod(ofs, plt.ax);
+			writePod(ofs, plt.bx);
+			writePod(ofs, plt.ay);
+			writePod(ofs, plt.by);
+		}
+	}
+	return ofs.good();
+}
+
+bool StitchingInfo::loadSIG(const std::string &fname, StitchingInfoGroup &group) {
+	std::ifstream ifs(fname, std::ios::binary);
+	if (!ifs.is_open()) return false;
+	char magic[sizeof(CALIB_FILE_MAGIC)] = {0};
+	int version = 0, groupSz = 0;
+	if (!ifs.read(magic, strlen(CALIB_FILE_MAGIC)) || strcmp(magic, CALIB_FILE_MAGIC) != 0
+		|| !readPod(ifs, version) || !readCnt(ifs, groupSz)) {
+		LOG_ERR("Not a calibration file: " << fname);
+		return false;
+	}
+	if (version < 1 || version > CALIB_FILE_VERSION) {
+		LOG_ERR("Calibration file " << fname << " of version " << version << " is not supported, the latest is " << CALIB_FILE_VERSION);
+		return false;
+	}
+
+	StitchingInfoGroup ret(groupSz);
+	bool isOk = true;
+	for (auto &sInfo:ret) {
+		int cnt = 0;
+		isOk = isOk && readPod(ifs, sInfo.imgCnt) && readPod(ifs, sInfo.srcType) && readPod(ifs, sInfo.nonBlackRatio)
+			&& readPod(ifs, sInfo.resizeSz) && readPod(ifs, sInfo.maskRatio.first) && readPod(ifs, sInfo.maskRatio.second);
+		isOk = isOk && readCnt(ifs, cnt);
+		sInfo.ranges.resize(isOk ? cnt : 0);
+		for (auto &r:sInfo.ranges) isOk = isOk && readPod(ifs, r);
+		isOk = isOk && readPod(ifs, sInfo.cropRect) && readCnt(ifs, cnt);
+		sInfo.cameras.resize(isOk ? cnt : 0);
+		for (auto &cam:sInfo.cameras) {
+			isOk = isOk && readPod(ifs, cam.focal) && readPod(ifs, cam.aspect) && readPod(ifs, cam.ppx) && readPod(ifs, cam.ppy)
+				&& FileUtil::readMatBinary(ifs, cam.R) && FileUtil::readMatBinary(ifs, cam.t);
+		}
+		isOk = isOk && FileUtil::readMatBinary(ifs, sInfo.projData) && readCnt(ifs, cnt);
+		for (int i = 0; isOk && i < cnt; ++i) {
+			supp::ResultRoi rr(Size(), Rect(), 0);
+			isOk = readPod(ifs, rr.srcSz) && readPod(ifs, rr.roi) && readPod(ifs, rr.imgIdx);
+			sInfo.resultRois.push_back(rr);
+		}
+		isOk = isOk && readCnt(ifs, cnt);
+		sInfo.pltHelpers.resize(isOk ? cnt : 0);
+		for (auto &plt:sInfo.pltHelpers)
+			isOk = isOk && readPod(ifs, plt.ax) && readPod(ifs, plt.bx) && readPod(ifs, plt.ay) && readPod(ifs, plt.by);
+		isOk = isOk && ifs.good();
+		if (!isOk) break;
+	}
+	if (!isOk) {
+		LOG_ERR("Calibration file " << fname << " is truncated or corrupted.");
+		return false;
+	}
+	group = ret;
+	return true;
+}
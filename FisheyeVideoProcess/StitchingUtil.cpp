@@ -1,6 +1,8 @@
 #include "StitchingUtil.h"
 #include "OtherUtils\ImageUtil.h"
+#include "Supplements\ExposureCompensators.h"
 #include <algorithm>
+#include <future>
 
 
 using namespace cv::detail;
@@ -315,16 +317,22 @@ StitchingInfo StitchingUtil::opencvStitching(const std::vector<Mat> &srcs, Mat &
 }
 
 StitchingInfo StitchingUtil::_stitch(
-	const std::vector<Mat> &srcs, Mat &dstImage, StitchingType sType, StitchingInfo &sInfoNotNull, const Size resizeSz, std::pair<double, double> &maskRatio) {
+	const std::vector<Mat> &srcs, Mat &dstImage, StitchingType sType, StitchingInfo &sInfoNotNull, const OpenCVStitchParam &osp,
+	const Size resizeSz, std::pair<double, double> &maskRatio, int stageIdx) {
 	std::vector<Mat> srcsGrayScale;
 	std::vector<std::pair<Point2f, Point2f>> matchedPair;
 	Mat tmp, tmpGrayScale, tmp2;
 	StitchingInfo sInfo;
 	switch (sType) {
 	case OPENCV_SELF_DEV:
-		 sInfo = resizeSz.area() > 0
-			? opencvSelfStitching(srcs, dstImage,resizeSz,sInfoNotNull, maskRatio)
-			: opencvSelfStitching(srcs, dstImage,sInfoNotNull, maskRatio);
+		// Warm start only from cameras of the same stitching unit at the same work scale
+		if (sInfoNotNull.isNull() && osp.isWarmStart && stageIdx < warmStarts.size()
+			&& warmStarts[stageIdx].cameras.size() == srcs.size() && osp.workMegapix == warmStartWorkMegapix
+			&& (resizeSz.area() == 0 || warmStarts[stageIdx].resizeSz == resizeSz)) {
+			sInfo = opencvSelfStitching(srcs, dstImage, resizeSz, sInfoNotNull, osp, maskRatio, warmStarts[stageIdx].cameras);
+		} else {
+			sInfo = opencvSelfStitching(srcs, dstImage, resizeSz, sInfoNotNull, osp, maskRatio);
+		}
 		break;
 	//case FACEBOOK:
 	//case SELF_SURF:
@@ -348,6 +356,26 @@ StitchingInfo StitchingUtil::_stitch(
 	return sInfo;
 }
 
+void StitchingUtil::addSeamStats(double ms, double cost, double flicker) {
+	cv::AutoLock lock(seamStatsMtx);
+	++seamStats.findCnt;
+	seamStats.ttlMs += ms;
+	seamStats.ttlCost += cost;
+	if (flicker >= 0) {
+		++seamStats.refindCnt;
+		seamStats.ttlFlicker += flicker;
+	}
+}
+
+void StitchingUtil::setWarmStart(const StitchingInfoGroup &sInfoG) {
+	warmStarts.assign(sInfoG.size(), WarmStartItem());
+	for (int i = 0; i < sInfoG.size(); ++i) {
+		warmStarts[i].resizeSz = sInfoG[i].resizeSz;
+		warmStarts[i].cameras = sInfoG[i].cameras;
+	}
+	warmStartWorkMegapix = osParam.workMegapix;
+}
+
 StitchingInfoGroup StitchingUtil::doStitch(
 	std::vector<Mat> &srcs, Mat &dstImage, StitchingInfoGroup &sInfoGNotNull, StitchingPolicy sp, StitchingType sType) {
 	// assumes srcs[0] is the front angle of view, so srcs[1] needs cut
@@ -371,10 +399,25 @@ StitchingInfoGroup StitchingUtil::doStitch(
 	return sInfoG;
 }
 
+StitchingInfoGroup StitchingUtil::doEstimate(
+	std::vector<Mat> &srcs, StitchingInfoGroup &sInfoGNotNull, StitchingPolicy sp, StitchingType sType) {
+	bool isRealStitching = osParam.isRealStitching, isGeometryOnly = osParam.isGeometryOnly;
+	osParam.isRealStitching = false;
+	osParam.isGeometryOnly = true;
+	Mat dummy;
+	StitchingInfoGroup sInfoG = doStitch(srcs, dummy, sInfoGNotNull, sp, sType);
+	osParam.isRealStitching = isRealStitching, osParam.isGeometryOnly = isGeometryOnly;
+	return sInfoG;
+}
+
 StitchingInfoGroup StitchingUtil::_stitchDoubleSide(
 	std::vector<Mat> &srcs, Mat &dstImage, StitchingInfoGroup &sInfoGNotNull, const StitchingPolicy sp, const StitchingType sType) {
 	ImageUtil iu;
 	StitchingInfoGroup sInfoG;
+	// Must be lvalues, so that compose caches are written back to sInfoGNotNull
+	// One for each stage, since stages may run concurrently and write their caches
+	StitchingInfo nullSInfos[4];
+#define SINFO_NOT_NULL(i) (sInfoGNotNull.empty() ? nullSInfos[i] : sInfoGNotNull[i])
 	if (sp == STITCH_DOUBLE_SIDE_ONCE_TIME) {
 		std::vector<Mat> tmpSrc;
 		assert(sInfoGNotNull.empty() || sInfoGNotNull.size() == 1);
@@ -382,16 +425,49 @@ StitchingInfoGroup StitchingUtil::_stitchDoubleSide(
 		tmpSrc.push_back(srcs[0](Range(0,srcs[0].rows), Range(0,srcs[0].cols*(0.5+OVERLAP_RATIO_DOUBLESIDE_4))).clone());
 		tmpSrc.push_back(srcs[0](Range(0,srcs[0].rows), Range(srcs[0].cols*(0.5-OVERLAP_RATIO_DOUBLESIDE_4), srcs[0].cols)).clone());
 		tmpSrc.push_back(srcs[1](Range(0,srcs[1].rows), Range(0,srcs[1].cols/2)).clone());
-		sInfoG.push_back(_stitch(tmpSrc, dstImage, sType, sInfoGNotNull.empty() ? StitchingInfo() : sInfoGNotNull[0], Size(), std::make_pair(1.0,0.7)));
+		sInfoG.push_back(_stitch(tmpSrc, dstImage, sType, SINFO_NOT_NULL(0), osParam, Size(), std::make_pair(1.0,0.7), 0));
 	} else if (sp == STITCH_DOUBLE_SIDE){
 		Mat dstBF, dstFB;
-		StitchingUtil::osParam.blend_strength = 5;
 		assert(sInfoGNotNull.empty() || sInfoGNotNull.size() == 4);
-		sInfoG.push_back(_stitch(srcs, dstFB, sType, sInfoGNotNull.empty() ? StitchingInfo() : sInfoGNotNull[0],FIX_RESIZE_0));
+		if (osParam.isSinglePassCompose && osParam.isRealStitching && !sInfoGNotNull.empty()) {
+			// Gains are frozen in the layers, so keyframes of exposure compensation are composed stage by stage,
+			// which solves gains again and captures new layers. Block gains are still smoothed in between
+			bool isGainKeyframe = false;
+			if (osParam.expos_comp_type == ExposureCompensator::GAIN_BLOCKS) {
+				for (auto &sInfo:sInfoGNotNull)
+					isGainKeyframe = isGainKeyframe || sInfo.gainFrameCnt + 1 >= EXPOS_COMP_KEYFRAME_INTERVAL;
+			}
+			if (!isGainKeyframe && composeDoubleSideSinglePass(srcs, dstImage, sInfoGNotNull)) {
+				for (auto &sInfo:sInfoGNotNull) {
+					++sInfo.gainFrameCnt;
+					supp::ReusableBlocksGainCompensator::smoothGainMaps(sInfo.gainMaps, sInfo.gainMapsTarget, EXPOS_COMP_SMOOTH_RATIO);
+				}
+				return sInfoGNotNull;
+			}
+			// Maps of all stages are captured again in this frame, so that they are consistent
+			for (auto &sInfo:sInfoGNotNull) {
+				sInfo.panoMaps.clear();
+				sInfo.panoCompositor.release();
+			}
+		}
+		// Each stage has its own params, instead of modifying the shared osParam
+		// Only the final stage may skip composing, since the others are sources of later stages
+		// Later stages blend narrower, at a fifth of the strength of osParam
+		OpenCVStitchParam ospFB = osParam, ospFBF = osParam, ospFinal = osParam;
+		ospFBF.blend_strength = osParam.blend_strength / 5;
+		ospFinal.blend_strength = osParam.blend_strength / 5;
+		ospFB.isGeometryOnly = ospFBF.isGeometryOnly = false;
+
+		// FB and BF are independent, so BF runs on another worker
+		std::vector<Mat> srcsBF(srcs.rbegin(), srcs.rend());
+		std::future<StitchingInfo> futureBF = std::async(std::launch::async, [&]() {
+			return _stitch(srcsBF, dstBF, sType, SINFO_NOT_NULL(1), ospFB, FIX_RESIZE_0, defaultMaskRatio, 1);
+		});
+		StitchingInfo sInfoFB = _stitch(srcs, dstFB, sType, SINFO_NOT_NULL(0), ospFB, FIX_RESIZE_0, defaultMaskRatio, 0);
+		StitchingInfo sInfoBF = futureBF.get();
+		sInfoG.push_back(sInfoFB);
 		if (!StitchingInfo::isSuccess(sInfoG)) return sInfoG;
-		std::reverse(srcs.begin(), srcs.end());
-		sInfoG.push_back(_stitch(srcs, dstBF, sType, sInfoGNotNull.empty() ? StitchingInfo() : sInfoGNotNull[1], FIX_RESIZE_0));
-		std::reverse(srcs.begin(), srcs.end());
+		sInfoG.push_back(sInfoBF);
 		//imshow("BF",dstBF);
 		//
 		//cvWaitKey();
@@ -402,24 +478,21 @@ StitchingInfoGroup StitchingUtil::_stitchDoubleSide(
 		const double overlapRatio_tolerance = min(0.45,OVERLAP_RATIO_DOUBLESIDE*1.25);
 		Mat dstTmp;
 		std::vector<Mat> tmpSrc;
-		tmpSrc.push_back(
-			/* dstFB --> sInfoG[0] */
-			dstFB(
-				Range(0,dstFB.rows), 
-				Range(max(0,int(sInfoG[0].ranges[0].end-ratio_2*sInfoG[0].ranges[0].size())),
-				min(dstFB.cols,int(sInfoG[0].ranges[1].start+ratio_2*sInfoG[0].ranges[1].size()))))
-				.clone());
-		tmpSrc.push_back(
-			/* dstBF --> sInfoG[1] */
-			dstBF(
-				Range(0,dstBF.rows),
-				Range(max(0,int(sInfoG[1].ranges[0].end-ratio_2*sInfoG[1].ranges[0].size())),
-					min(dstBF.cols,int(sInfoG[1].ranges[1].start+ratio_2*sInfoG[1].ranges[1].size()))))
-				.clone());
+		/* dstFB --> sInfoG[0] */
+		Range rangeFB(max(0,int(sInfoG[0].ranges[0].end-ratio_2*sInfoG[0].ranges[0].size())),
+			min(dstFB.cols,int(sInfoG[0].ranges[1].start+ratio_2*sInfoG[0].ranges[1].size())));
+		/* dstBF --> sInfoG[1] */
+		Range rangeBF(max(0,int(sInfoG[1].ranges[0].end-ratio_2*sInfoG[1].ranges[0].size())),
+			min(dstBF.cols,int(sInfoG[1].ranges[1].start+ratio_2*sInfoG[1].ranges[1].size())));
+		tmpSrc.push_back(dstFB(Range(0,dstFB.rows), rangeFB).clone());
+		tmpSrc.push_back(dstBF(Range(0,dstBF.rows), rangeBF).clone());
 
 		// dstTmp: F-B-F
-		StitchingUtil::osParam.blend_strength = 1;
-		sInfoG.push_back(_stitch(tmpSrc,dstTmp,sType, sInfoGNotNull.empty() ? StitchingInfo() : sInfoGNotNull[2], FIX_RESIZE_1,std::make_pair(overlapRatio_tolerance,0.7)));	
+		sInfoG.push_back(_stitch(tmpSrc,dstTmp,sType, SINFO_NOT_NULL(2), ospFBF, FIX_RESIZE_1,std::make_pair(overlapRatio_tolerance,0.7), 2));	
+		if (!SINFO_NOT_NULL(2).panoMaps.empty()) {
+			SINFO_NOT_NULL(2).panoMaps.srcOffsets[0] = Point(rangeFB.start, 0);
+			SINFO_NOT_NULL(2).panoMaps.srcOffsets[1] = Point(rangeBF.start, 0);
+		}
 		//imshow("FBF",dstTmp);
 		//cvWaitKey();
 		if (!StitchingInfo::isSuccess(sInfoG)) return sInfoG;
@@ -428,13 +501,17 @@ StitchingInfoGroup StitchingUtil::_stitchDoubleSide(
 			dstTmp(Range(0,dstTmp.rows), sInfoG[2].ranges[1]).clone());
 		tmpSrc.push_back(
 			dstTmp(Range(0,dstTmp.rows), sInfoG[2].ranges[0]).clone());
-		StitchingUtil::osParam.blend_strength = 1;
-		sInfoG.push_back(_stitch(tmpSrc,dstImage,sType, sInfoGNotNull.empty() ? StitchingInfo() : sInfoGNotNull[3], FIX_RESIZE_2,std::make_pair(overlapRatio_tolerance,0.7)));
+		sInfoG.push_back(_stitch(tmpSrc,dstImage,sType, SINFO_NOT_NULL(3), ospFinal, FIX_RESIZE_2,std::make_pair(overlapRatio_tolerance,0.7), 3));
+		if (!SINFO_NOT_NULL(3).panoMaps.empty()) {
+			SINFO_NOT_NULL(3).panoMaps.srcOffsets[0] = Point(sInfoG[2].ranges[1].start, 0);
+			SINFO_NOT_NULL(3).panoMaps.srcOffsets[1] = Point(sInfoG[2].ranges[0].start, 0);
+		}
 	} else if (sp == STITCH_DOUBLE_SIDE_NOT_DIRECTION_CORRECTION) {
 		Mat dstFB;
-		StitchingUtil::osParam.blend_strength = 5;
+		OpenCVStitchParam osp = osParam, ospFinal = osParam;
+		osp.isGeometryOnly = false;
 		assert(sInfoGNotNull.empty() || sInfoGNotNull.size() == 2);
-		sInfoG.push_back(_stitch(srcs, dstFB, sType, sInfoGNotNull.empty() ? StitchingInfo() : sInfoGNotNull[0],FIX_RESIZE_0));
+		sInfoG.push_back(_stitch(srcs, dstFB, sType, SINFO_NOT_NULL(0), osp, FIX_RESIZE_0, defaultMaskRatio, 0));
 
 
 		if (!StitchingInfo::isSuccess(sInfoG)) return sInfoG;
@@ -449,14 +526,39 @@ StitchingInfoGroup StitchingUtil::_stitchDoubleSide(
 				Range(0,dstFB.rows), 
 				Range(0, int(sInfoG[0].ranges[0].end)))
 				.clone());
-		StitchingUtil::osParam.blend_strength = 5;
-		sInfoG.push_back(_stitch(tmpSrc,dstImage,sType, sInfoGNotNull.empty() ? StitchingInfo() : sInfoGNotNull[1], FIX_RESIZE_1));
+		sInfoG.push_back(_stitch(tmpSrc,dstImage,sType, SINFO_NOT_NULL(1), ospFinal, FIX_RESIZE_1, defaultMaskRatio, 1));
 
 	}
-
+#undef SINFO_NOT_NULL
 	return sInfoG;
 }
 
+bool StitchingUtil::composeDoubleSideSinglePass(const std::vector<Mat> &srcs, Mat &dstImage, StitchingInfoGroup &sInfoG) {
+	assert(sInfoG.size() == 4);
+	for (auto &sInfo:sInfoG) {
+		if (sInfo.panoMaps.empty()) return false;
+	}
+
+	Ptr<supp::PanoCompositor> &compositor = sInfoG.back().panoCompositor;
+	Size dstSz = osParam.outputSz.area() > 0 ? osParam.outputSz : sInfoG.back().panoMaps.size();
+	if (compositor.empty() || compositor->size() != dstSz) {
+		// FB: (F, B), BF: (B, F), F-B-F: (FB, BF), final: (F-B-F, F-B-F)
+		std::vector<const supp::PanoMaps*> stages;
+		for (auto &sInfo:sInfoG) stages.push_back(&sInfo.panoMaps);
+		std::vector<std::vector<int>> sources(4);
+		sources[0].push_back(0), sources[0].push_back(1);
+		sources[1].push_back(1), sources[1].push_back(0);
+		sources[2].push_back(supp::PanoCompositor::fromStage(0)), sources[2].push_back(supp::PanoCompositor::fromStage(1));
+		sources[3].push_back(supp::PanoCompositor::fromStage(2)), sources[3].push_back(supp::PanoCompositor::fromStage(2));
+		compositor = makePtr<supp::PanoCompositor>();
+		compositor->build(stages, sources, 3, dstSz);
+		LOG_MESS("Single-pass compositor built, layers: " << compositor->layerCnt() << ", blend bands: " << compositor->bandCnt()
+			<< ", size: " << compositor->size());
+	}
+	compositor->compose(srcs, dstImage);
+	return true;
+}
+
 void StitchingUtil::getGrayScaleAndFiltered(const std::vector<Mat> &src, std::vector<Mat> &dst) {
 	for (int i=0; i<src.size(); ++i) {
 		Mat tmp1,tmp2;
@@ -487,19 +589,53 @@ std::vector<Rect> StitchingUtil::getMaskROI(const Mat &srcImage, bool isLeft, st
 }
 
 std::vector<Rect> StitchingUtil::getMaskROI(const Mat &srcImage, int index, int total, std::pair<double, double> &ratio) {
+	return getMaskROI(srcImage.size(), index, total, ratio);
+}
+
+std::vector<Rect> StitchingUtil::getMaskROI(Size srcSz, int index, int total, std::pair<double, double> &ratio) {
 	double widthParam = ratio.first, heightParam = ratio.second;
 	std::vector<Rect> ret;
 	if (ratio.first >=0.5 && index > 0 && index < total-1) {
-		ret.push_back(Rect(0,0,srcImage.cols, round(srcImage.rows*heightParam)));
+		ret.push_back(Rect(0,0,srcSz.width, round(srcSz.height*heightParam)));
 	} else {
 		if (index < total - 1) 
-			ret.push_back(Rect(srcImage.cols-round(srcImage.cols*(widthParam)),0,round(srcImage.cols*widthParam),round(srcImage.rows*heightParam)));
+			ret.push_back(Rect(srcSz.width-round(srcSz.width*(widthParam)),0,round(srcSz.width*widthParam),round(srcSz.height*heightParam)));
 		if (index > 0) 
-			ret.push_back(Rect(0,0,round(srcImage.cols*widthParam),round(srcImage.rows*heightParam)));
+			ret.push_back(Rect(0,0,round(srcSz.width*widthParam),round(srcSz.height*heightParam)));
 	}
 	return ret;
 }
 
+std::vector<Mat> StitchingUtil::getOverlapThumbs(const std::vector<Mat> &srcs, std::pair<double, double> &ratio) {
+	std::vector<Mat> thumbs;
+	int n = srcs.size();
+	for (int i = 0; i < n; ++i) {
+		Mat gray;
+		cvtColor(srcs[i], gray, CV_BGR2GRAY);
+		// STITCH_DOUBLE_SIDE stitches srcs in both orders, so strips of both sides are watched
+		std::vector<Rect> rois = getMaskROI(gray, i, n, ratio), roisReversed = getMaskROI(gray, n-1-i, n, ratio);
+		rois.insert(rois.end(), roisReversed.begin(), roisReversed.end());
+		for (auto &roi:rois) {
+			Mat thumb;
+			resize(gray(roi), thumb, Size(), OVERLAP_THUMB_SCALE, OVERLAP_THUMB_SCALE, INTER_AREA);
+			thumbs.push_back(thumb);
+		}
+	}
+	return thumbs;
+}
+
+double StitchingUtil::overlapThumbsDiff(const std::vector<Mat> &thumbs, const std::vector<Mat> &refThumbs) {
+	if (thumbs.size() != refThumbs.size()) return DBL_MAX;
+	double ttlDiff = 0;
+	for (int i = 0; i < thumbs.size(); ++i) {
+		if (thumbs[i].size() != refThumbs[i].size()) return DBL_MAX;
+		Mat diff;
+		absdiff(thumbs[i], refThumbs[i], diff);
+		ttlDiff += mean(diff)[0];
+	}
+	return thumbs.empty() ? 0.0 : ttlDiff / thumbs.size();
+}
+
 void StitchingUtil::showMatchingPair(
 	const Mat &left,
 	const std::vector<KeyPoint> &kptL,
@@ -550,6 +686,7 @@ bool StitchingUtil::removeBlackPixelByDoubleScan(Mat &src, Mat &dst, StitchingIn
 	double restRatioPercent = (maxRows-minRows+1)*(maxCols-minCols+1)*1.0/(tmpSrc.cols*tmpSrc.rows);
 	LOG_MESS("Remove black pixel, remain:" << restRatioPercent*100 << "%%");
 	dst = src(Range(minRows,maxRows), Range(minCols,maxCols)).clone();
+	sInfo.cropRect = Rect(minCols, minRows, maxCols-minCols, maxRows-minRows);
 	if (restRatioPercent < NONBLACK_REMAIN_FLOOR) {
 		LOG_ERR("removeBlackPixelByDoubleScan() only remain " << restRatioPercent*100 <<"%% of src.");
 		return false;
@@ -564,127 +701,138 @@ bool StitchingUtil::removeBlackPixelByDoubleScan(Mat &src, Mat &dst, StitchingIn
 	return true;
 	
 }
-// REF: http://stackoverflow.com/questions/21410449/how-do-i-crop-to-largest-interior-bounding-box-in-opencv
-bool StitchingUtil::removeBlackPixelByContourBound(Mat &src, Mat &dst, StitchingInfo &sInfo) {
+bool StitchingUtil::removeBlackPixelByMaxInteriorRect(Mat &src, Mat &dst, StitchingInfo &sInfo) {
 	Mat grayscale;
 	cvtColor(src, grayscale, CV_BGR2GRAY);
 	Mat mask = grayscale > BLACK_TOLERANCE;
 
+	// Only the border is removed, so the largest component is taken with its holes filled
 	std::vector<std::vector<Point>> contours;
-	std::vector<Vec4i> hierarchy;
-
-	findContours(mask, contours, hierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_NONE, Point(0,0));
-	Mat contourImg = Mat::zeros(src.size(), CV_8UC3);
-
-	int maxSz = 0, id = 0;
+	findContours(mask, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE, Point(0,0));
+	if (contours.empty()) {
+		LOG_WARN("removeBlackPixelByMaxInteriorRect() found nothing but black. Using removeBlackPixelByDoubleScan() instead.");
+		return false;
+	}
+	int id = 0;
+	double maxArea = 0;
 	for (int i=0; i<contours.size(); ++i) {
-		if (contours.at(i).size() > maxSz) {
-			maxSz = contours.at(i).size();
+		double area = contourArea(contours[i]);
+		if (area > maxArea) {
+			maxArea = area;
 			id = i;
 		}
 	}
+	Mat contourMask = Mat::zeros(src.size(), CV_8UC1);
+	drawContours(contourMask, contours, id, Scalar(255), -1);
 
-	Mat contourMask = cv::Mat::zeros(src.size(), CV_8UC1);
-	drawContours(contourMask, contours, id, Scalar(255), -1, 8, hierarchy,0,Point());
-
-	std::vector<Point> cSortedX = contours.at(id);
-	std::sort(cSortedX.begin(), cSortedX.end(), [](const Point &a, const Point &b){return a.x<b.x;});
-	std::vector<Point> cSortedY = contours.at(id);
-	std::sort(cSortedY.begin(), cSortedY.end(), [](const Point &a, const Point &b){return a.y<b.y;});
-	int minX = 0, maxX = cSortedX.size()-1;
-	int minY = 0, maxY = cSortedY.size()-1;
-
-	Rect interiorBoundingBox;
-
-	while(minX < maxX && minY < maxY) {
-		Point minP(cSortedX[minX].x, cSortedY[minY].y);
-		Point maxP(cSortedX[maxX].x, cSortedY[maxY].y);
-		interiorBoundingBox = Rect(minP.x, minP.y, maxP.x-minP.x, maxP.y-minP.y);
-		// out-codes
-		bool ocTop = false, ocBottom = false, ocLeft = false, ocRight = false;
-
-		if (checkInterior(contourMask, interiorBoundingBox, ocTop, ocBottom, ocLeft, ocRight))
-			break;
-		if (ocLeft) ++minX;
-		if (ocRight)--maxX;
-		if (ocTop) ++minY;
-		if (ocBottom) --maxY;
-		if (!(ocLeft || ocRight || ocTop || ocBottom)) {
-			LOG_WARN("removeBlackPixelByContourBound() failed. Using removeBlackPixelByDoubleScan() instead.");
-			return false;
-		}
-
-	}
-	double restRatioPercent = interiorBoundingBox.size().area()*1.0/src.size().area();
+	Rect interiorBoundingBox = maxInteriorRect(contourMask);
+	double restRatioPercent = interiorBoundingBox.area()*1.0/src.size().area();
 	LOG_MESS("Remove black pixel, remain:" << interiorBoundingBox << " " << restRatioPercent*100 << "%%");
 	dst = src(interiorBoundingBox).clone();
+	sInfo.cropRect = interiorBoundingBox;
 	if (restRatioPercent < NONBLACK_REMAIN_FLOOR) {
-		LOG_ERR("removeBlackPixelByContourBound() only remain " << restRatioPercent*100 <<"%% of src.")
+		LOG_ERR("removeBlackPixelByMaxInteriorRect() only remain " << restRatioPercent*100 <<"%% of src.")
 		return false;
-#ifdef SHOW_IMAGE
-		imshow("src",src);
-		imshow("dst",dst);
-		cvWaitKey();
-#endif
 	}
 	sInfo.setRanges(Range(interiorBoundingBox.tl().x, interiorBoundingBox.tl().x+interiorBoundingBox.width));
 	sInfo.nonBlackRatio = restRatioPercent;
 	return true;
 }
 
-bool StitchingUtil::checkInterior(const Mat& mask, const Rect& interiorBB, bool& top, bool& bottom, bool& left, bool& right) {
-	bool ret = true;
-	Mat sub = mask(interiorBB);
-	int x=0,y=0;
-	int _top = 0, _bottom = 0, _left = 0, _right = 0;
-
-	for (; x<sub.cols; ++x) {
-		if (sub.at<unsigned char>(y,x) <= BLACK_TOLERANCE) {
-			ret = false;
-			++_top;
-		}
-	}
-	for (y=sub.rows-1, x=0; x<sub.cols; ++x) {
-		if (sub.at<unsigned char>(y,x) <= BLACK_TOLERANCE) {
-			ret = false;
-			++_bottom;
-		}
-	}
-	for (x=0,y=0; y<sub.rows; ++y) {
-		if (sub.at<unsigned char>(y,x) <= BLACK_TOLERANCE) {
-			ret = false;
-			++_left;
+Rect StitchingUtil::maxInteriorRect(const Mat &mask) {
+	CV_Assert(mask.type() == CV_8UC1);
+	Rect best;
+	// heights[x]: non-zero run ending at the current row. The extra zero column flushes the stack at the row end
+	std::vector<int> heights(mask.cols+1, 0), stack(mask.cols+1);
+	for (int y=0; y<mask.rows; ++y) {
+		const uchar *m = mask.ptr<uchar>(y);
+		int *h = &heights[0];
+		// Branch-free, so that the compiler vectorizes it
+		for (int x=0; x<mask.cols; ++x)
+			h[x] = (h[x]+1) & -int(m[x] != 0);
+
+		// Largest rectangle under the histogram, each column is pushed and popped once
+		int top = 0;
+		for (int x=0; x<=mask.cols; ++x) {
+			while (top > 0 && h[stack[top-1]] >= h[x]) {
+				int height = h[stack[--top]];
+				int left = top > 0 ? stack[top-1]+1 : 0;
+				if (height*(x-left) > best.area())
+					best = Rect(left, y-height+1, x-left, height);
+			}
+			stack[top++] = x;
 		}
 	}
-	for (x=sub.cols-1,y=0; y<sub.rows; ++y) {
-		if (sub.at<unsigned char>(y,x) <= BLACK_TOLERANCE) {
-			ret = false;
-			++_right;
-		}
-	}
-
-	if (_top > _bottom) {
-		top = (_top > _left && _top > _right);
-	} else {
-		bottom = (_bottom > _left && _bottom > _right);
-	}
-
-	if (_left >= _right) {
-		left = (_left >= _bottom && _left >= _top);
-	} else {
-		right = (_right >= _top && _right >= _bottom);
-	}
-	return ret;
+	return best;
 }
 
 void StitchingUtil::removeBlackPixel(Mat &src, Mat &dst, StitchingInfo &sInfo) {
 	StitchingInfo sf = sInfo;
 	Mat dsttmp;
-	if (!removeBlackPixelByContourBound(src,dst,sInfo)) {
+	if (!removeBlackPixelByMaxInteriorRect(src,dst,sInfo)) {
 		removeBlackPixelByDoubleScan(src,dsttmp, sf);
 		if (sf.evaluate() > sInfo.evaluate()) {
 			dst = dsttmp.clone();
 			sInfo = sf;
 		}
 	}
-}
\ No newline at end of file
+}
+
+OpenCVStitchParam QualityGovernor::degrade(const OpenCVStitchParam &base, int level) {
+	// Levels are cumulative, each one keeps the savings of the former
+	OpenCVStitchParam osp = base;
+	if (level >= QUALITY_FEWER_BANDS) osp.blend_strength = base.blend_strength / 2;
+	if (level >= QUALITY_FEATHER) osp.blend_type = supp::BLENDER_PRECOMPUTED_FEATHER;
+	if (level >= QUALITY_LOW_SEAM) osp.seamMegapix = base.seamMegapix / 2;
+	if (level >= QUALITY_NO_SEAM_SEARCH) osp.isSeamSearch = false;
+	if (level >= QUALITY_FAST_REGISTRATION) osp.setFeaturesTier(FEATURES_ORB);
+	return osp;
+}
+
+const char* QualityGovernor::levelName(int level) {
+	static const char *names[] = {"full", "fewer bands", "feather", "low seam", "no seam search", "fast registration"};
+	return names[level];
+}
+
+/* Levels which only change composing of each stage */
+static bool isComposeLevel(int level) {
+	return level >= QUALITY_FEWER_BANDS && level <= QUALITY_NO_SEAM_SEARCH;
+}
+
+void QualityGovernor::reset(const OpenCVStitchParam &osp, double fps) {
+	baseParam = osp;
+	budgetMs = fps > 0 ? 1000.0 / fps : 0;
+	smoothedMs = 0;
+	level = QUALITY_FULL;
+	holdCnt = 0;
+}
+
+bool QualityGovernor::update(double frameMs, OpenCVStitchParam &osp) {
+	if (budgetMs <= 0) return false;
+	smoothedMs = smoothedMs == 0 ? frameMs : smoothedMs + (frameMs - smoothedMs) * GOVERNOR_SMOOTH_RATIO;
+	if (holdCnt > 0) {
+		--holdCnt;
+		return false;
+	}
+
+	// Frames of a known calibration are composed by the single-pass compositor, whose cost compose levels don't change
+	bool isSinglePass = osp.isSinglePassCompose && osp.isRealStitching;
+	int preLevel = level;
+	if (smoothedMs > budgetMs * GOVERNOR_DOWN_RATIO && level < QUALITY_LEVEL_CNT - 1) {
+		do ++level; while (isSinglePass && isComposeLevel(level));
+	} else if (smoothedMs < budgetMs * GOVERNOR_UP_RATIO && level > QUALITY_FULL) {
+		do --level; while (isSinglePass && isComposeLevel(level));
+	}
+	if (level == preLevel) return false;
+
+	osp = degrade(baseParam, level);
+	holdCnt = GOVERNOR_HOLD_FRAMES;
+	if (level > preLevel) {
+		LOG_WARN("Quality " << levelName(preLevel) << " -> " << levelName(level) << ", latency "
+			<< smoothedMs << "ms over budget " << budgetMs << "ms");
+	} else {
+		LOG_MARK("Quality " << levelName(preLevel) << " -> " << levelName(level) << ", latency "
+			<< smoothedMs << "ms within budget " << budgetMs << "ms");
+	}
+	return true;
+}
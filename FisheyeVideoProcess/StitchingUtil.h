@@ -4,6 +4,10 @@
 #include <unordered_map>
 #include <unordered_set>
 #include ".\Supplements\RewarpableWarper.h"
+#include ".\Supplements\Blenders.h"
+#include ".\Supplements\PanoCompositor.h"
+#include ".\Supplements\SeamFinders.h"
+#include <deque>
 #include ".\OtherUtils\IntervalBestValueMaintainer.h"
 #include ".\OtherUtils\FileUtil.h"
 
@@ -44,6 +48,19 @@ enum StitchingPolicy {
 	STITCH_DOUBLE_SIDE_ONCE_TIME,
 };
 
+/* Feature detectors of registration, from the most reliable to the fastest */
+enum FeaturesTier {
+	FEATURES_SIFT,
+	FEATURES_AKAZE,
+	FEATURES_ORB,
+};
+
+/* Seam finders of composing */
+enum SeamFinderType {
+	SEAM_GRAPH_CUT,		// cv::detail::GraphCutSeamFinder on color
+	SEAM_TEMPORAL_DP,	// supp::TemporalDpSeamFinder, following seams of former frames
+};
+
 struct OpenCVStitchParam {
 		double workMegapix;
 		double seamMegapix;
@@ -52,9 +69,21 @@ struct OpenCVStitchParam {
 		cv::detail::WaveCorrectKind wave_correct;
 		int expos_comp_type;
 		float match_conf;
-		int blend_type;
+		int featuresTier;	// FeaturesTier
+		int maxKeypoints;	// Per image, shared among its overlap strips. 0 means unlimited
+		int blend_type;	// cv::detail::Blender types, or supp::BLENDER_PRECOMPUTED_FEATHER
 		float blend_strength;
+		bool isSeamSearch;	// Find new seams if former ones can't be reused, or else blend warped masks as they are
+		int seamFinderType;	// SeamFinderType
+		bool isSeamStats;	// Measure each seam finding into StitchingUtil::getSeamStats(), for benchmarking only
 		bool isRealStitching;
+		bool isSinglePassCompose;	// Compose frames of a known STITCH_DOUBLE_SIDE group in one pass. Opt-in, layers are feather blended
+		bool isGeometryOnly;	// Without isRealStitching, output the covered area instead of composed pixels
+		Size outputSz;	// Size of the delivered panorama, single-pass composing targets it directly. Empty if native
+		bool isWarmStart;	// Bundle adjustment of estimation starts from StitchingUtil::setWarmStart cameras if given
+		int warmBAMaxIters;	// Iteration budget of warm started bundle adjustment
+		double warmBAMaxMs;	// Time budget of it, checked every WARM_BA_CHUNK_ITERS iterations
+		double warmBAEps;	// Converged once focals (relative) and rotations change less than it in a chunk
 
 		OpenCVStitchParam() {
 			workMegapix = 0.8;
@@ -63,11 +92,93 @@ struct OpenCVStitchParam {
 			conf_thresh = 0.7;
 			wave_correct = cv::detail::WAVE_CORRECT_HORIZ;
 			expos_comp_type = cv::detail::ExposureCompensator::GAIN_BLOCKS;
-			match_conf = 0.3f;
+			setFeaturesTier(FEATURES_SIFT);
 			blend_type = cv::detail::Blender::MULTI_BAND;
+			isSeamSearch = true;
+			seamFinderType = SEAM_GRAPH_CUT;
+			isSeamStats = false;
 			isRealStitching = true;
+			isSinglePassCompose = false;
+			isGeometryOnly = false;
+			isWarmStart = true;
+			warmBAMaxIters = 50;
+			warmBAMaxMs = 100;
+			warmBAEps = 1e-4;
 			blend_strength = 5;
 		}
+
+		/*
+			Detector along with its keypoint cap and match_conf. SIFT keeps its former 0.3,
+			the others follow the opencv stitching sample (0.3 for ORB, 0.65 for the rest)
+		*/
+		void setFeaturesTier(FeaturesTier tier) {
+			featuresTier = tier;
+			switch (tier) {
+			case FEATURES_SIFT:
+				maxKeypoints = 0;
+				match_conf = 0.3f;
+				break;
+			case FEATURES_AKAZE:
+				maxKeypoints = 3000;
+				match_conf = 0.65f;
+				break;
+			case FEATURES_ORB:
+				maxKeypoints = 1500;
+				match_conf = 0.3f;
+				break;
+			}
+		}
+		/* Take the detector, keypoint cap and match_conf of osp */
+		void setFeaturesTierOf(const OpenCVStitchParam &osp) {
+			featuresTier = osp.featuresTier;
+			maxKeypoints = osp.maxKeypoints;
+			match_conf = osp.match_conf;
+		}
+};
+
+/*
+	Quality levels of stitching, each one cheaper than the former.
+	FEWER_BANDS to NO_SEAM_SEARCH only change composing of each stage, which single-pass composing skips
+*/
+enum QualityLevel {
+	QUALITY_FULL,
+	QUALITY_FEWER_BANDS,		// Half blend strength, one band less
+	QUALITY_FEATHER,			// Precomputed feather blending instead of multi-band
+	QUALITY_LOW_SEAM,			// Half seam megapixels
+	QUALITY_NO_SEAM_SEARCH,		// Seams are only reused, or else warped masks are blended as they are
+	QUALITY_FAST_REGISTRATION,	// FEATURES_ORB registration
+
+	QUALITY_LEVEL_CNT,
+};
+
+/*
+	Steps stitching quality down while per-frame latency exceeds the budget of the target frame rate,
+	and back up once there is headroom. A level is held for some frames after each transition to avoid oscillation.
+	Levels without effect on the current params (compose levels under single-pass composing) are skipped.
+*/
+class QualityGovernor {
+	#define GOVERNOR_SMOOTH_RATIO 0.2	/* Per-frame ratio of moving smoothed latency towards the measured one */
+	#define GOVERNOR_DOWN_RATIO 1.0		/* Step down once smoothed latency exceeds it of the budget */
+	#define GOVERNOR_UP_RATIO 0.6		/* Step up once smoothed latency is below it of the budget */
+	#define GOVERNOR_HOLD_FRAMES 10		/* Frames kept at a level after a transition */
+	OpenCVStitchParam baseParam;
+	double budgetMs;	// 0 if not governed
+	double smoothedMs;
+	int level;			// QualityLevel
+	int holdCnt;
+
+public:
+	QualityGovernor():budgetMs(0),smoothedMs(0),level(QUALITY_FULL),holdCnt(0){}
+
+	/* Start from full quality params osp, for the target frame rate. fps <= 0 disables governing */
+	void reset(const OpenCVStitchParam &osp, double fps);
+	/* Feed latency of a frame. Return true on a transition, with osp set to params of the new level */
+	bool update(double frameMs, OpenCVStitchParam &osp);
+	int getLevel() const {return level;}
+
+	/* Params of the given level, degraded from full quality ones */
+	static OpenCVStitchParam degrade(const OpenCVStitchParam &base, int level);
+	static const char* levelName(int level);
 };
 
 class StitchingUtil;
@@ -89,12 +200,48 @@ public:
 
 	/* Indicates width-wise ranges of each src in stitched result*/
 	std::vector<Range> ranges;
+	/* Area kept by removeBlackPixel(), in the blended result */
+	Rect cropRect;
 
 	std::vector<cv::detail::CameraParams> cameras;
 	Mat projData;
 	std::vector<supp::ResultRoi> resultRois;
 	std::vector<supp::PlaneLinearTransformHelper> pltHelpers;
 
+	/* Seam masks at seam scale, reused by later frames while geometry and overlapped content remain */
+	std::vector<UMat> seamMasks;
+	std::vector<Point> seamCorners;
+	std::vector<UMat> seamRefImages;
+	supp::SeamPaths seamPaths;	// Of SEAM_TEMPORAL_DP, empty for other seam finders
+	/* Blending masks at compose scale derived from seam masks, valid as long as seams are reused */
+	std::vector<Mat> composeMasks;
+	/* Resized and warped images of composing, kept to avoid reallocation every frame. Never copied */
+	std::vector<Mat> composeImgBuffs, composeWarpedBuffs;
+
+	/* Exposure gain maps. Target ones are solved on keyframes, applied ones are smoothed towards them */
+	std::vector<Mat> gainMaps;
+	std::vector<Mat> gainMapsTarget;
+	int gainFrameCnt;	// Frames since the last keyframe
+
+	/* Captured on the first real compose of a calibration. The compositor only lives in the last stage of a group */
+	supp::PanoMaps panoMaps;
+	Ptr<supp::PanoCompositor> panoCompositor;
+
+	/* Outcome of removeBlackPixel() on the coverage of the blended result, reused while the compose geometry remains */
+	struct CropCache {
+		Rect dstRoi;	// Compose geometry it is found in, empty if not found yet
+		Mat projData;	// Calibration it is found in, since masks may change within the same dstRoi
+		std::vector<supp::PlaneLinearTransformHelper> pltHelpers;
+		Rect cropRect;
+		double nonBlackRatio;
+		std::vector<Range> ranges;
+		CropCache():nonBlackRatio(0){}
+		bool isFoundIn(Rect roi, const Mat &proj, const std::vector<supp::PlaneLinearTransformHelper> &plts) const {
+			return dstRoi.area() > 0 && dstRoi == roi && plts == pltHelpers
+				&& proj.size() == projData.size() && proj.type() == projData.type() && (proj.empty() || norm(proj, projData, NORM_INF) == 0);
+		}
+	} cropCache;
+
 	StitchingInfo(){clear();}
 	StitchingInfo(const StitchingInfo &sinfo);
 	StitchingInfo& operator = (const StitchingInfo &sinfo);
@@ -115,8 +262,12 @@ public:
 	static bool isSuccess(const StitchingInfoGroup &);
 	/* Score <class StitchingInfoGroup> */
 	static double evaluate(const StitchingInfoGroup &);
-	/* Calculate an average <class StitchingInfoGroup> */
-	static void getAverageSIG(const std::vector<StitchingInfoGroup*> &pSIGs, StitchingInfoGroup &ret);
+	/* Calculate an average <class StitchingInfoGroup>, matching features with match_conf of the tier they are found with */
+	static void getAverageSIG(const std::vector<StitchingInfoGroup*> &pSIGs, StitchingInfoGroup &ret, float matchConf);
+	/* Versioned binary calibration file of <class StitchingInfoGroup>, with all composing needs but no compose caches */
+	static bool saveSIG(const std::string &fname, const StitchingInfoGroup &);
+	/* Return false if the file is missing, of a newer version or corrupted, leaving the group untouched */
+	static bool loadSIG(const std::string &fname, StitchingInfoGroup &);
 };
 
 /* A window-size of <class StitchingInfoGroup> */
@@ -147,7 +298,7 @@ class LocalStitchingInfoGroup {
 public:
 	LocalStitchingInfoGroup(int _wSize = LSIG_WINDOW_SIZE):wSize(_wSize){
 		groups = IntervalBestValueMaintainer<StitchingInfoGroup,double>(
-			int(LSIG_BEST_CAND_NUM),int(LSIG_WINDOW_SIZE),&StitchingInfo::evaluate);
+			int(LSIG_BEST_CAND_NUM),wSize,&StitchingInfo::evaluate);
 	}
 	~LocalStitchingInfoGroup(){
 		for (auto src:stitchingWaitingBuffPersistedSize)
@@ -174,8 +325,10 @@ public:
 	void clearStitchedBuff() {stitchedBuff.clear();}
 
 	void collectGarbage(int fidx);
-	/* Obtain averaged <class StitchingInfoGroup> from <class LocalStitchingInfoGroup> */
-	StitchingInfoGroup getAver(int head, int tail, std::vector<int>&, StitchingUtil &);
+	/* Obtain averaged <class StitchingInfoGroup> from <class LocalStitchingInfoGroup>. Compose caches are kept in it */
+	StitchingInfoGroup& getAver(int head, int tail, std::vector<int>&, StitchingUtil &);
+	/* The last <class StitchingInfoGroup> obtained by getAver successfully, empty if none */
+	const StitchingInfoGroup& getPreSuccessSIG() const {return preSuccessSIG;}
 	/* Set <class PlaneLinearTransformHelper> for <class LocalStitchingInfoGroup> */
 	bool adjustPltForLSIG(StitchingInfoGroup &, const std::vector<int>&, StitchingUtil &);
 
@@ -184,6 +337,17 @@ public:
 
 
 class StitchingUtil {
+public:
+	/* Seam finding of composing, accumulated for benchmarking if OpenCVStitchParam::isSeamStats */
+	struct SeamStats {
+		int findCnt;
+		double ttlMs;
+		double ttlCost;		// supp::seamCost()
+		int refindCnt;		// Finds with former seams of the same geometry
+		double ttlFlicker;	// supp::seamFlicker() against the former seams
+		SeamStats():findCnt(0),ttlMs(0),ttlCost(0),refindCnt(0),ttlFlicker(0){}
+	};
+
 private:
 	#define kFlannMaxDistScale 3
 	#define kFlannMaxDistThreshold 0.04
@@ -193,6 +357,13 @@ private:
 	#define OVERLAP_RATIO_DOUBLESIDE_4 0.15
 	#define BLACK_TOLERANCE 3
 	#define NONBLACK_REMAIN_FLOOR 0.70
+	#define SEAM_REUSE_DIFF_THRESH 10.0	/* Mean abs diff (0-255) of overlapped content to trigger seam re-finding */
+	#define DP_SEAM_TEMPORAL_PENALTY 4.f	/* Cost (color diff 0-765) per pixel a DP seam moves away from the former one, each row */
+	#define EXPOS_COMP_KEYFRAME_INTERVAL 15	/* Frames between two exposure gains solving */
+	#define EXPOS_COMP_SMOOTH_RATIO 0.2	/* Per-frame ratio of moving applied gains towards the solved ones */
+	#define BLENDER_POOL_MAX_SIZE 8
+	#define OVERLAP_THUMB_SCALE 0.125	/* Downsampling of overlap strips for motion scoring */
+	#define WARM_BA_CHUNK_ITERS 5	/* Iterations of warm started bundle adjustment between two budget checks */
 
 	/* Unify the resized size of each step */
 	#define FIX_RESIZE_0 Size(1440,1440)
@@ -228,39 +399,100 @@ private:
 	void unzipMatchedPair(std::vector<std::pair<Point2f, Point2f>> &, std::vector<Point2f> &, std::vector<Point2f> &);
 	void getGrayScaleAndFiltered(const std::vector<Mat> &, std::vector<Mat> &);
 
-	/* Stitching unit op */
+	/*
+		Stitching unit op. osp is used instead of osParam, so that stages can run concurrently with their own params.
+		stageIdx: Index of the stitching unit in the stitching policy
+	*/
 	StitchingInfo _stitch(
-		const std::vector<Mat> &srcs, Mat &dstImage, StitchingType sType,StitchingInfo &sInfoNotNull, const Size resizeSz = Size(), std::pair<double, double> &ratio=defaultMaskRatio );
+		const std::vector<Mat> &srcs, Mat &dstImage, StitchingType sType,StitchingInfo &sInfoNotNull, const OpenCVStitchParam &osp,
+		const Size resizeSz = Size(), std::pair<double, double> &ratio=defaultMaskRatio, int stageIdx = 0);
 	/* Stitching multiple time trying to reduce seam */
 	StitchingInfoGroup _stitchDoubleSide(std::vector<Mat> &srcs, Mat &dstImage, StitchingInfoGroup &, const StitchingPolicy sp, const StitchingType sType);
 
 	/* Different ways to find max interior rectangle to remove black pixels surrounded */
 	static bool removeBlackPixelByDoubleScan(Mat &, Mat &, StitchingInfo &);
-	static bool removeBlackPixelByContourBound(Mat &, Mat &, StitchingInfo &);
-	static bool checkInterior(const Mat& mask, const Rect& interiorBB, bool &top, bool &bottom, bool &left, bool &right);
+	static bool removeBlackPixelByMaxInteriorRect(Mat &, Mat &, StitchingInfo &);
+	/* Largest axis-aligned rectangle of non-zero pixels in a CV_8UC1 mask, in O(W*H) */
+	static Rect maxInteriorRect(const Mat &mask);
+
+	/* Compose a STITCH_DOUBLE_SIDE panorama in one pass by maps captured in the group. Return false if not captured yet */
+	bool composeDoubleSideSinglePass(const std::vector<Mat> &srcs, Mat &dstImage, StitchingInfoGroup &sInfoG);
+
+	/* Mean abs diff between images and reference ones, only counted in overlapped areas */
+	static double overlapDiffScore(
+		const std::vector<UMat> &images, const std::vector<UMat> &refImages, const std::vector<Point> &corners, const std::vector<UMat> &masks);
+	/* Indicates whether seams of sInfo can be used for the given warped images */
+	static bool isSeamReusable(
+		const StitchingInfo &sInfo, const std::vector<UMat> &images, const std::vector<Point> &corners, const std::vector<UMat> &masks);
+
+	/* Warping maps shared by every warper, reused while calibration remains the same */
+	supp::WarpMapsCache warpMapsCache;
+	/* Blenders kept across frames, one for each blending type, output geometry and owner */
+	struct BlenderPoolItem {
+		int type;
+		Rect dstRoi;
+		float param;	// Number of bands, or sharpness
+		const void *owner;	// Not shared between owners, since stitching stages may run concurrently
+		Ptr<cv::detail::Blender> blender;
+	};
+	std::deque<BlenderPoolItem> blenderPool;
+	cv::Mutex blenderPoolMtx;
+	Ptr<cv::detail::Blender> getPersistentBlender(int type, Rect dst_roi, float param, const void *owner);
+	/* A new blender of MULTI_BAND (param: number of bands) or supp::BLENDER_PRECOMPUTED_FEATHER (param: sharpness) */
+	static Ptr<cv::detail::Blender> createPersistentBlender(int type, float param);
+	/* Cameras of a former calibration, one item for each stitching unit */
+	struct WarmStartItem {
+		Size resizeSz;
+		std::vector<cv::detail::CameraParams> cameras;
+	};
+	std::vector<WarmStartItem> warmStarts;
+	double warmStartWorkMegapix;	// Cameras are at the work scale of it
+	SeamStats seamStats;
+	cv::Mutex seamStatsMtx;
+	/* flicker < 0 if there are no former seams of the same geometry */
+	void addSeamStats(double ms, double cost, double flicker);
 public:
 	OpenCVStitchParam osParam;
 	StitchingType stitchingType;
 	StitchingPolicy stitchingPolicy;
 
-	StitchingUtil(){osParam = OpenCVStitchParam();}
+	StitchingUtil(){osParam = OpenCVStitchParam(); warmStartWorkMegapix = 0;}
 	~StitchingUtil(){};
 
 	/* Get ROI Mask */
 	static Mat getMask(const Mat &srcImage, bool isLeft, std::pair<double, double> &ratio=defaultMaskRatio);
 	static std::vector<cv::Rect> getMaskROI(const Mat &srcImage, bool isLeft, std::pair<double, double> &ratio=defaultMaskRatio);
 	static std::vector<cv::Rect> getMaskROI(const Mat &srcImage, int index, int total, std::pair<double, double> &ratio=defaultMaskRatio);
+	static std::vector<cv::Rect> getMaskROI(Size srcSz, int index, int total, std::pair<double, double> &ratio=defaultMaskRatio);
+	/* Downsampled luma of the overlap strips of srcs, in both stitching orders */
+	static std::vector<Mat> getOverlapThumbs(const std::vector<Mat> &srcs, std::pair<double, double> &ratio=defaultMaskRatio);
+	/* Mean abs diff (0-255) between overlap thumbs of two frames, as a cheap motion score */
+	static double overlapThumbsDiff(const std::vector<Mat> &thumbs, const std::vector<Mat> &refThumbs);
 
 	/* Stitching pipeline based on opencv Stitcher */
 	StitchingInfo opencvSelfStitching(
 		const std::vector<Mat> &srcs, Mat &dstImage,StitchingInfo &sInfo, std::pair<double, double> &maskRatio=defaultMaskRatio);
 	StitchingInfo opencvSelfStitching(
 		const std::vector<Mat> &srcs, Mat &dstImage, const Size resizeSz, StitchingInfo &sInfo, std::pair<double, double> &maskRatio=defaultMaskRatio);
+	/*
+		With given params. Sources are resized to the smallest one if resizeSz is empty.
+		warmCameras: Cameras of a former calibration of srcs (at work scale), to start bundle adjustment from
+	*/
+	StitchingInfo opencvSelfStitching(
+		const std::vector<Mat> &srcs, Mat &dstImage, Size resizeSz, StitchingInfo &sInfo, const OpenCVStitchParam &osp, std::pair<double, double> &maskRatio,
+		const std::vector<cv::detail::CameraParams> &warmCameras = std::vector<cv::detail::CameraParams>());
 	
 	static void removeBlackPixel(Mat &src, Mat &dst, StitchingInfo &sInfo);
 	
 	/* Stitching interface */
 	StitchingInfoGroup doStitch(
 		std::vector<Mat> &srcs, Mat &dstImage,StitchingInfoGroup &, StitchingPolicy sp = STITCH_ONE_SIDE, StitchingType sType = OPENCV_DEFAULT);
+	/* Estimation interface. No seam finding, exposure compensation or blending, and no pixels for the final stage */
+	StitchingInfoGroup doEstimate(
+		std::vector<Mat> &srcs, StitchingInfoGroup &, StitchingPolicy sp = STITCH_ONE_SIDE, StitchingType sType = OPENCV_DEFAULT);
+	/* Start bundle adjustment of later estimations from cameras of sInfoG, e.g. a former calibration. Empty to disable */
+	void setWarmStart(const StitchingInfoGroup &sInfoG);
+	SeamStats getSeamStats() {cv::AutoLock lock(seamStatsMtx); return seamStats;}
+	void resetSeamStats() {cv::AutoLock lock(seamStatsMtx); seamStats = SeamStats();}
 };
 
@@ -0,0 +1,283 @@
+#include "Blenders.h"
+using namespace supp;
+
+#define WEIGHT_EPS 1e-5f
+
+void PersistentMultiBandBlender::prepare(Rect dst_roi) {
+	if (dst_roi == dst_roi_final_ && !dst_pyr_laplace_.empty()) {
+		// Same geometry, only reset the accumulated data
+		for (int i = 0; i <= num_bands_; ++i) {
+			dst_pyr_laplace_[i].setTo(Scalar::all(0));
+			dst_band_weights_[i].setTo(0);
+		}
+		feed_cnt_ = 0;
+		return;
+	}
+
+	dst_roi_final_ = dst_roi;
+
+	// Crop unnecessary bands
+	double max_len = static_cast<double>(std::max(dst_roi.width, dst_roi.height));
+	num_bands_ = std::min(actual_num_bands_, static_cast<int>(ceil(std::log(max_len) / std::log(2.0))));
+
+	// Add border to the final image, to ensure sizes are divided by (1 << num_bands_)
+	dst_roi.width += ((1 << num_bands_) - dst_roi.width % (1 << num_bands_)) % (1 << num_bands_);
+	dst_roi.height += ((1 << num_bands_) - dst_roi.height % (1 << num_bands_)) % (1 << num_bands_);
+	dst_roi_ = dst_roi;
+
+	dst_pyr_laplace_.resize(num_bands_ + 1);
+	dst_band_weights_.resize(num_bands_ + 1);
+	dst_up_.resize(num_bands_ + 1);
+	dst_pyr_laplace_[0].create(dst_roi.size(), CV_16SC3);
+	dst_band_weights_[0].create(dst_roi.size(), CV_32F);
+	for (int i = 1; i <= num_bands_; ++i) {
+		dst_pyr_laplace_[i].create((dst_pyr_laplace_[i - 1].rows + 1) / 2,
+								   (dst_pyr_laplace_[i - 1].cols + 1) / 2, CV_16SC3);
+		dst_band_weights_[i].create((dst_band_weights_[i - 1].rows + 1) / 2,
+									(dst_band_weights_[i - 1].cols + 1) / 2, CV_32F);
+	}
+	for (int i = 0; i <= num_bands_; ++i) {
+		dst_pyr_laplace_[i].setTo(Scalar::all(0));
+		dst_band_weights_[i].setTo(0);
+	}
+	img_pyrs_.clear();
+	feed_cnt_ = 0;
+}
+
+void PersistentMultiBandBlender::feed(InputArray _img, InputArray _mask, Point tl) {
+	Mat img = _img.getMat(), mask = _mask.getMat();
+	CV_Assert(img.type() == CV_16SC3 || img.type() == CV_8UC3);
+	CV_Assert(mask.type() == CV_8U);
+
+	// Keep source image in memory with small border
+	int gap = 3 * (1 << num_bands_);
+	Point tl_new(std::max(dst_roi_.x, tl.x - gap),
+				 std::max(dst_roi_.y, tl.y - gap));
+	Point br_new(std::min(dst_roi_.br().x, tl.x + img.cols + gap),
+				 std::min(dst_roi_.br().y, tl.y + img.rows + gap));
+
+	// Ensure coordinates of top-left, bottom-right corners are divided by (1 << num_bands_).
+	// After that scale between layers is exactly 2.
+	tl_new.x = dst_roi_.x + (((tl_new.x - dst_roi_.x) >> num_bands_) << num_bands_);
+	tl_new.y = dst_roi_.y + (((tl_new.y - dst_roi_.y) >> num_bands_) << num_bands_);
+	int width = br_new.x - tl_new.x;
+	int height = br_new.y - tl_new.y;
+	width += ((1 << num_bands_) - width % (1 << num_bands_)) % (1 << num_bands_);
+	height += ((1 << num_bands_) - height % (1 << num_bands_)) % (1 << num_bands_);
+	br_new.x = tl_new.x + width;
+	br_new.y = tl_new.y + height;
+	int dy = std::max(br_new.y - dst_roi_.br().y, 0);
+	int dx = std::max(br_new.x - dst_roi_.br().x, 0);
+	tl_new.x -= dx; br_new.x -= dx;
+	tl_new.y -= dy; br_new.y -= dy;
+
+	if (feed_cnt_ >= img_pyrs_.size()) img_pyrs_.resize(feed_cnt_ + 1);
+	ImagePyr &p = img_pyrs_[feed_cnt_++];
+	Rect rc(tl_new.x - dst_roi_.x, tl_new.y - dst_roi_.y, br_new.x - tl_new.x, br_new.y - tl_new.y);
+	if (rc != p.rc || img.type() != p.img_with_border.type()) {
+		p.rc = rc;
+		p.is_weight_valid = false;
+	}
+	p.top = tl.y - tl_new.y;
+	p.left = tl.x - tl_new.x;
+	p.bottom = br_new.y - tl.y - img.rows;
+	p.right = br_new.x - tl.x - img.cols;
+
+	copyMakeBorder(img, p.img_with_border, p.top, p.bottom, p.left, p.right, BORDER_REFLECT);
+
+	// Weight pyramid is reused if the mask remains the same
+	if (p.is_weight_valid && (p.mask.size() != mask.size() || norm(p.mask, mask, NORM_INF) != 0))
+		p.is_weight_valid = false;
+	if (!p.is_weight_valid) mask.copyTo(p.mask);
+}
+
+void PersistentMultiBandBlender::buildImagePyr(int img_idx) {
+	ImagePyr &p = img_pyrs_[img_idx];
+	p.gauss.resize(num_bands_ + 1);
+	p.up.resize(num_bands_ + 1);
+	p.laplace.resize(num_bands_ + 1);
+
+	// Image Laplacian pyramid. CV_8U input goes through 8-bit Gaussian levels directly
+	p.gauss[0] = p.img_with_border;
+	for (int i = 0; i < num_bands_; ++i)
+		pyrDown(p.gauss[i], p.gauss[i + 1]);
+	for (int i = 0; i < num_bands_; ++i) {
+		pyrUp(p.gauss[i + 1], p.up[i], p.gauss[i].size());
+		subtract(p.gauss[i], p.up[i], p.laplace[i], noArray(), CV_16S);
+	}
+	p.gauss[num_bands_].convertTo(p.laplace[num_bands_], CV_16S);
+
+	// Weight map Gaussian pyramid
+	if (!p.is_weight_valid) {
+		p.weight_gauss.resize(num_bands_ + 1);
+		Mat weight_map;
+		p.mask.convertTo(weight_map, CV_32F, 1./255.);
+		copyMakeBorder(weight_map, p.weight_gauss[0], p.top, p.bottom, p.left, p.right, BORDER_CONSTANT);
+		for (int i = 0; i < num_bands_; ++i)
+			pyrDown(p.weight_gauss[i], p.weight_gauss[i + 1]);
+		p.is_weight_valid = true;
+	}
+}
+
+void PersistentMultiBandBlender::accumulateBand(int band) {
+	// Images are added in feeding order, so the result is deterministic
+	for (int img_idx = 0; img_idx < feed_cnt_; ++img_idx) {
+		const ImagePyr &p = img_pyrs_[img_idx];
+		Rect rc(p.rc.x >> band, p.rc.y >> band, p.rc.width >> band, p.rc.height >> band);
+		const Mat &src_pyr_laplace = p.laplace[band];
+		const Mat &weight_pyr_gauss = p.weight_gauss[band];
+		Mat dst_pyr_laplace = dst_pyr_laplace_[band](rc);
+		Mat dst_band_weights = dst_band_weights_[band](rc);
+
+		for (int y = 0; y < rc.height; ++y) {
+			const Point3_<short>* src_row = src_pyr_laplace.ptr<Point3_<short> >(y);
+			Point3_<short>* dst_row = dst_pyr_laplace.ptr<Point3_<short> >(y);
+			const float* weight_row = weight_pyr_gauss.ptr<float>(y);
+			float* dst_weight_row = dst_band_weights.ptr<float>(y);
+
+			for (int x = 0; x < rc.width; ++x) {
+				dst_row[x].x += static_cast<short>(src_row[x].x * weight_row[x]);
+				dst_row[x].y += static_cast<short>(src_row[x].y * weight_row[x]);
+				dst_row[x].z += static_cast<short>(src_row[x].z * weight_row[x]);
+				dst_weight_row[x] += weight_row[x];
+			}
+		}
+	}
+}
+
+void PersistentMultiBandBlender::normalizeBand(int band) {
+	Mat &src = dst_pyr_laplace_[band];
+	const Mat &weight = dst_band_weights_[band];
+	for (int y = 0; y < src.rows; ++y) {
+		Point3_<short> *row = src.ptr<Point3_<short> >(y);
+		const float *weight_row = weight.ptr<float>(y);
+
+		for (int x = 0; x < src.cols; ++x) {
+			float w = 1.f / (weight_row[x] + WEIGHT_EPS);
+			row[x].x = static_cast<short>(row[x].x * w);
+			row[x].y = static_cast<short>(row[x].y * w);
+			row[x].z = static_cast<short>(row[x].z * w);
+		}
+	}
+}
+
+void PersistentMultiBandBlender::blend(InputOutputArray dst, InputOutputArray dst_mask) {
+	parallel_for_(Range(0, feed_cnt_), ParallelBody(this, &PersistentMultiBandBlender::buildImagePyr));
+	parallel_for_(Range(0, num_bands_ + 1), ParallelBody(this, &PersistentMultiBandBlender::accumulateBand));
+	parallel_for_(Range(0, num_bands_ + 1), ParallelBody(this, &PersistentMultiBandBlender::normalizeBand));
+
+	// Restore image from Laplacian pyramid
+	for (int i = num_bands_; i > 0; --i) {
+		pyrUp(dst_pyr_laplace_[i], dst_up_[i - 1], dst_pyr_laplace_[i - 1].size());
+		add(dst_up_[i - 1], dst_pyr_laplace_[i - 1], dst_pyr_laplace_[i - 1]);
+	}
+
+	Rect dst_rc(0, 0, dst_roi_final_.width, dst_roi_final_.height);
+	compare(dst_band_weights_[0](dst_rc), WEIGHT_EPS, dst_mask_final_, CMP_GT);
+	compare(dst_band_weights_[0](dst_rc), WEIGHT_EPS, dst_mask_zero_, CMP_LE);
+	Mat result = dst_pyr_laplace_[0](dst_rc);
+	result.setTo(Scalar::all(0), dst_mask_zero_);
+
+	// Views of inner buffers, valid until next prepare()
+	dst.assign(result);
+	dst_mask.assign(dst_mask_final_);
+}
+
+void PrecomputedFeatherBlender::prepare(Rect dst_roi) {
+	if (dst_roi == dst_roi_ && !dst_acc_.empty()) {
+		dst_acc_.setTo(Scalar::all(0));
+		feed_cnt_ = 0;
+		return;
+	}
+	dst_roi_ = dst_roi;
+	dst_acc_.create(dst_roi.size(), CV_32FC3);
+	dst_acc_.setTo(Scalar::all(0));
+	weights_.clear();
+	is_weight_valid_ = false;
+	feed_cnt_ = 0;
+}
+
+void PrecomputedFeatherBlender::feed(InputArray _img, InputArray _mask, Point tl) {
+	Mat img = _img.getMat(), mask = _mask.getMat();
+	CV_Assert(img.type() == CV_16SC3 || img.type() == CV_8UC3);
+	CV_Assert(mask.type() == CV_8U);
+
+	if (feed_cnt_ >= weights_.size()) {
+		weights_.resize(feed_cnt_ + 1);
+		is_weight_valid_ = false;
+	}
+	ImageWeight &w = weights_[feed_cnt_++];
+	Rect rc(tl - dst_roi_.tl(), img.size());
+	if (rc != w.rc || w.mask.size() != mask.size() || norm(w.mask, mask, NORM_INF) != 0) {
+		w.rc = rc;
+		w.mask = mask.clone();
+		is_weight_valid_ = false;
+	}
+
+	w.img = img;
+	if (is_weight_valid_) accumulate(w);
+}
+
+void PrecomputedFeatherBlender::calcWeights() {
+	weight_sum_.create(dst_roi_.size(), CV_32F);
+	weight_sum_.setTo(0);
+	for (int i = 0; i < weights_.size(); ++i) {
+		Mat dist;
+		distanceTransform(weights_[i].mask, dist, DIST_L1, 3);
+		threshold(dist * sharpness_, weights_[i].weight, 1.f, 1.f, THRESH_TRUNC);
+		Mat sum_roi = weight_sum_(weights_[i].rc);
+		add(sum_roi, weights_[i].weight, sum_roi);
+	}
+	compare(weight_sum_, WEIGHT_EPS, dst_mask_final_, CMP_GT);
+	for (int i = 0; i < weights_.size(); ++i) {
+		Mat sum_roi = weight_sum_(weights_[i].rc) + WEIGHT_EPS;
+		divide(weights_[i].weight, sum_roi, weights_[i].weight);
+	}
+}
+
+template <typename T>
+static void accumulateWeighted(const Mat &img, const Mat &weight, Mat &dst) {
+	for (int y = 0; y < img.rows; ++y) {
+		const Point3_<T> *src_row = img.ptr<Point3_<T> >(y);
+		const float *weight_row = weight.ptr<float>(y);
+		Point3f *dst_row = dst.ptr<Point3f>(y);
+		for (int x = 0; x < img.cols; ++x) {
+			dst_row[x].x += src_row[x].x * weight_row[x];
+			dst_row[x].y += src_row[x].y * weight_row[x];
+			dst_row[x].z += src_row[x].z * weight_row[x];
+		}
+	}
+}
+
+void supp::accumulateWithWeights(const Mat &img, const Mat &weight, Mat &dst) {
+	CV_Assert(img.size() == weight.size() && img.size() == dst.size());
+	if (img.depth() == CV_8U)
+		accumulateWeighted<uchar>(img, weight, dst);
+	else
+		accumulateWeighted<short>(img, weight, dst);
+}
+
+void PrecomputedFeatherBlender::accumulate(const ImageWeight &w) {
+	Mat dst = dst_acc_(w.rc);
+	accumulateWithWeights(w.img, w.weight, dst);
+}
+
+void PrecomputedFeatherBlender::blend(InputOutputArray dst, InputOutputArray dst_mask) {
+	if (feed_cnt_ != weights_.size()) {
+		weights_.resize(feed_cnt_);
+		is_weight_valid_ = false;
+	}
+	if (!is_weight_valid_) {
+		// Masks changed in this frame, so images fed before are accumulated again with the new weights
+		LOG_MESS("PrecomputedFeatherBlender: Recalculate weights.");
+		calcWeights();
+		dst_acc_.setTo(Scalar::all(0));
+		for (int i = 0; i < weights_.size(); ++i) accumulate(weights_[i]);
+		is_weight_valid_ = true;
+	}
+	for (int i = 0; i < weights_.size(); ++i) weights_[i].img.release();
+
+	// Views of inner buffers, valid until next prepare()
+	dst.assign(dst_acc_);
+	dst_mask.assign(dst_mask_final_);
+}
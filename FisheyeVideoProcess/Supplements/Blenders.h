@@ -0,0 +1,97 @@
+#include "..\Config.h"
+#include <opencv2\stitching\detail\blenders.hpp>
+
+#pragma once
+namespace supp {
+	/* Extends cv::detail::Blender::NO, FEATHER and MULTI_BAND */
+	enum {BLENDER_PRECOMPUTED_FEATHER = cv::detail::Blender::MULTI_BAND + 1};
+
+	/* dst += img * weight. img is CV_8UC3 or CV_16SC3, weight is CV_32F and dst is CV_32FC3, all of the same size */
+	void accumulateWithWeights(const Mat &img, const Mat &weight, Mat &dst);
+
+	/*
+		cv::detail::MultiBandBlender which lives across frames for a fixed output geometry.
+		Pyramid buffers (and weight pyramids of unchanged masks) are kept, so no allocation in steady state.
+		feed() only stores the input (CV_8UC3 or CV_16SC3), pyramids are built in blend() in parallel over images,
+		then accumulated in parallel over bands.
+	*/
+	class PersistentMultiBandBlender : public cv::detail::Blender {
+	public:
+		PersistentMultiBandBlender(int num_bands = 5):actual_num_bands_(num_bands),num_bands_(0),feed_cnt_(0){}
+
+		int numBands() const {return actual_num_bands_;}
+		void setNumBands(int val) {actual_num_bands_ = val;}
+
+		using cv::detail::Blender::prepare;
+		void prepare(Rect dst_roi);
+		void feed(InputArray img, InputArray mask, Point tl);
+		void blend(InputOutputArray dst, InputOutputArray dst_mask);
+
+	private:
+		struct ImagePyr {
+			Rect rc;	// Bordered area in dst at level 0
+			int top, bottom, left, right;
+			Mat img_with_border;
+			std::vector<Mat> gauss, up, laplace;
+			Mat mask;
+			bool is_weight_valid;
+			std::vector<Mat> weight_gauss;
+			ImagePyr():is_weight_valid(false){}
+		};
+
+		class ParallelBody : public ParallelLoopBody {
+		public:
+			ParallelBody(PersistentMultiBandBlender *_b, void (PersistentMultiBandBlender::*_op)(int)):b(_b),op(_op){}
+			void operator()(const Range &r) const {for (int i = r.start; i < r.end; ++i) (b->*op)(i);}
+		private:
+			PersistentMultiBandBlender *b;
+			void (PersistentMultiBandBlender::*op)(int);
+		};
+
+		void buildImagePyr(int img_idx);
+		void accumulateBand(int band);
+		void normalizeBand(int band);
+
+		int actual_num_bands_, num_bands_;
+		Rect dst_roi_final_;
+		int feed_cnt_;
+		std::vector<ImagePyr> img_pyrs_;
+		std::vector<Mat> dst_pyr_laplace_, dst_band_weights_, dst_up_;
+		Mat dst_mask_final_, dst_mask_zero_;
+	};
+
+	/*
+		Feather blending for a fixed geometry. Weights are normalized in the output coordinates once,
+		and kept until the geometry or any mask changes. Then each image only needs one weighted accumulation.
+		Result is CV_32FC3.
+	*/
+	class PrecomputedFeatherBlender : public cv::detail::Blender {
+	public:
+		PrecomputedFeatherBlender(float sharpness = 0.02f):sharpness_(sharpness),feed_cnt_(0),is_weight_valid_(false){}
+
+		float sharpness() const {return sharpness_;}
+		void setSharpness(float val) {sharpness_ = val; is_weight_valid_ = false;}
+
+		using cv::detail::Blender::prepare;
+		void prepare(Rect dst_roi);
+		void feed(InputArray img, InputArray mask, Point tl);
+		void blend(InputOutputArray dst, InputOutputArray dst_mask);
+
+	private:
+		struct ImageWeight {
+			Rect rc;	// Area in dst
+			Mat mask;
+			Mat weight;	// Normalized
+			Mat img;	// Image fed in current frame, not copied
+		};
+
+		void calcWeights();
+		void accumulate(const ImageWeight &w);
+
+		float sharpness_;
+		int feed_cnt_;
+		bool is_weight_valid_;
+		std::vector<ImageWeight> weights_;
+		Mat dst_acc_, weight_sum_, dst_mask_final_;
+	};
+}
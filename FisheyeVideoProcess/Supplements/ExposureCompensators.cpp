@@ -0,0 +1,101 @@
+#include "ExposureCompensators.h"
+using namespace supp;
+
+void ReusableBlocksGainCompensator::feed(const std::vector<Point> &corners, const std::vector<UMat> &images,
+										 const std::vector<std::pair<UMat,uchar> > &masks)
+{
+	CV_Assert(corners.size() == images.size() && images.size() == masks.size());
+
+	const int num_images = static_cast<int>(images.size());
+
+	std::vector<Size> bl_per_imgs(num_images);
+	std::vector<Point> block_corners;
+	std::vector<UMat> block_images;
+	std::vector<std::pair<UMat,uchar> > block_masks;
+
+	// Construct blocks for gain compensator
+	for (int img_idx = 0; img_idx < num_images; ++img_idx)
+	{
+		Size bl_per_img((images[img_idx].cols + bl_width_ - 1) / bl_width_,
+						(images[img_idx].rows + bl_height_ - 1) / bl_height_);
+		int bl_width = (images[img_idx].cols + bl_per_img.width - 1) / bl_per_img.width;
+		int bl_height = (images[img_idx].rows + bl_per_img.height - 1) / bl_per_img.height;
+		bl_per_imgs[img_idx] = bl_per_img;
+		for (int by = 0; by < bl_per_img.height; ++by)
+		{
+			for (int bx = 0; bx < bl_per_img.width; ++bx)
+			{
+				Point bl_tl(bx * bl_width, by * bl_height);
+				Point bl_br(std::min(bl_tl.x + bl_width, images[img_idx].cols),
+							std::min(bl_tl.y + bl_height, images[img_idx].rows));
+
+				block_corners.push_back(corners[img_idx] + bl_tl);
+				block_images.push_back(images[img_idx](Rect(bl_tl, bl_br)));
+				block_masks.push_back(std::make_pair(masks[img_idx].first(Rect(bl_tl, bl_br)),
+													 masks[img_idx].second));
+			}
+		}
+	}
+
+	cv::detail::GainCompensator compensator;
+	compensator.feed(block_corners, block_images, block_masks);
+	std::vector<double> gains = compensator.gains();
+	gain_maps_.resize(num_images);
+
+	Mat_<float> ker(1, 3);
+	ker(0,0) = 0.25; ker(0,1) = 0.5; ker(0,2) = 0.25;
+
+	int bl_idx = 0;
+	for (int img_idx = 0; img_idx < num_images; ++img_idx)
+	{
+		Size bl_per_img = bl_per_imgs[img_idx];
+		Mat_<float> gain_map(bl_per_img);
+		for (int by = 0; by < bl_per_img.height; ++by)
+			for (int bx = 0; bx < bl_per_img.width; ++bx, ++bl_idx)
+				gain_map(by, bx) = static_cast<float>(gains[bl_idx]);
+
+		sepFilter2D(gain_map, gain_maps_[img_idx], CV_32F, ker, ker);
+		sepFilter2D(gain_maps_[img_idx], gain_maps_[img_idx], CV_32F, ker, ker);
+	}
+}
+
+void ReusableBlocksGainCompensator::apply(int index, Point /*corner*/, InputOutputArray _image, InputArray /*mask*/)
+{
+	CV_Assert(_image.type() == CV_8UC3);
+
+	Mat_<float> gain_map;
+	if (gain_maps_[index].size() == _image.size())
+		gain_map = gain_maps_[index];
+	else
+		resize(gain_maps_[index], gain_map, _image.size(), 0, 0, INTER_LINEAR);
+
+	Mat image = _image.getMat();
+	for (int y = 0; y < image.rows; ++y)
+	{
+		const float* gain_row = gain_map.ptr<float>(y);
+		Point3_<uchar>* row = image.ptr<Point3_<uchar> >(y);
+		for (int x = 0; x < image.cols; ++x)
+		{
+			row[x].x = saturate_cast<uchar>(row[x].x * gain_row[x]);
+			row[x].y = saturate_cast<uchar>(row[x].y * gain_row[x]);
+			row[x].z = saturate_cast<uchar>(row[x].z * gain_row[x]);
+		}
+	}
+}
+
+void ReusableBlocksGainCompensator::smoothGainMaps(std::vector<Mat> &cur, const std::vector<Mat> &target, double ratio) {
+	bool consistent = cur.size() == target.size();
+	for (int i=0; consistent && i<cur.size(); ++i)
+		consistent = cur[i].size() == target[i].size();
+	if (!consistent) {
+		cur = std::vector<Mat>(target.size());
+		for (int i=0; i<target.size(); ++i) cur[i] = target[i].clone();
+		return;
+	}
+	// New Mats are created since cur may be shared by copies of <class StitchingInfo>
+	for (int i=0; i<cur.size(); ++i) {
+		Mat tmp;
+		addWeighted(cur[i], 1-ratio, target[i], ratio, 0, tmp);
+		cur[i] = tmp;
+	}
+}
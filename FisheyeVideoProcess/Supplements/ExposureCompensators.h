@@ -0,0 +1,27 @@
+#include "..\Config.h"
+#include <opencv2\stitching\detail\exposure_compensate.hpp>
+
+#pragma once
+namespace supp {
+	/* cv::detail::BlocksGainCompensator whose gain maps can be obtained and set, so that they are reusable across frames */
+	class ReusableBlocksGainCompensator : public cv::detail::ExposureCompensator {
+	public:
+		ReusableBlocksGainCompensator(int bl_width = 32, int bl_height = 32)
+			:bl_width_(bl_width), bl_height_(bl_height) {}
+
+		using cv::detail::ExposureCompensator::feed;
+		void feed(const std::vector<Point> &corners, const std::vector<UMat> &images,
+			const std::vector<std::pair<UMat,uchar> > &masks);
+		void apply(int index, Point corner, InputOutputArray image, InputArray mask);
+
+		std::vector<Mat> getGainMaps() const {return gain_maps_;}
+		void setGainMaps(const std::vector<Mat> &maps) {gain_maps_ = maps;}
+
+		/* Move cur towards target by given ratio. cur is reset to target when they are not consistent */
+		static void smoothGainMaps(std::vector<Mat> &cur, const std::vector<Mat> &target, double ratio);
+
+	private:
+		int bl_width_, bl_height_;
+		std::vector<Mat> gain_maps_;
+	};
+}
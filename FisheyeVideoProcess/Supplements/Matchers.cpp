@@ -6,10 +6,12 @@ AKAZEFeaturesFinder::AKAZEFeaturesFinder(int descriptor_type,
 										 float threshold,
 										 int nOctaves,
 										 int nOctaveLayers,
-										 int diffusivity)
+										 int diffusivity,
+										 int max_keypoints)
 {
 	akaze = AKAZE::create(descriptor_type, descriptor_size, descriptor_channels,
 						  threshold, nOctaves, nOctaveLayers, diffusivity);
+	maxKeypoints = max_keypoints;
 }
 
 void AKAZEFeaturesFinder::find(InputArray image, detail::ImageFeatures &features)
@@ -17,7 +19,13 @@ void AKAZEFeaturesFinder::find(InputArray image, detail::ImageFeatures &features
 	CV_Assert((image.type() == CV_8UC3) || (image.type() == CV_8UC1));
 	Mat descriptors;
 	UMat uimage = image.getUMat();
-	akaze->detectAndCompute(uimage, UMat(), features.keypoints, descriptors);
+	if (maxKeypoints > 0) {
+		akaze->detect(uimage, features.keypoints);
+		KeyPointsFilter::retainBest(features.keypoints, maxKeypoints);
+		akaze->compute(uimage, features.keypoints, descriptors);
+	} else {
+		akaze->detectAndCompute(uimage, UMat(), features.keypoints, descriptors);
+	}
 	features.descriptors = descriptors.getUMat(ACCESS_READ);
 }
 
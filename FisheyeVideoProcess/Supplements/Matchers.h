@@ -10,7 +10,7 @@
 
 #pragma once
 namespace supp {
-	/* cv:detail::FeaturesFinder using AKAZE */
+	/* cv:detail::FeaturesFinder using AKAZE. Only the strongest max_keypoints are kept if it is positive */
 	class  AKAZEFeaturesFinder : public detail::FeaturesFinder {
 	public:
 		AKAZEFeaturesFinder(int descriptor_type = AKAZE::DESCRIPTOR_MLDB,
@@ -19,12 +19,14 @@ namespace supp {
 							float threshold = 0.001f,
 							int nOctaves = 4,
 							int nOctaveLayers = 4,
-							int diffusivity = KAZE::DIFF_PM_G2);
+							int diffusivity = KAZE::DIFF_PM_G2,
+							int max_keypoints = 0);
 
 	private:
 		void find(InputArray image, detail::ImageFeatures &features);
 
 		Ptr<AKAZE> akaze;
+		int maxKeypoints;
 	};
 
 	/* cv::detail::FeaturesFinder using SIFT */
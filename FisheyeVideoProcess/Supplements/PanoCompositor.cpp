@@ -0,0 +1,193 @@
+#include "PanoCompositor.h"
+#include "Blenders.h"
+using namespace supp;
+
+#define WEIGHT_EPS 1e-5f
+#define EXCLUSIVE_WEIGHT_EPS 1e-3f	// A layer of at least 1 minus it is taken as the only one
+
+/* img *= gain per pixel. img is CV_8UC3, gain is CV_32F of the same size */
+static void applyGain(Mat &img, const Mat &gain) {
+	for (int y = 0; y < img.rows; ++y) {
+		const float *g = gain.ptr<float>(y);
+		Vec3b *p = img.ptr<Vec3b>(y);
+		for (int x = 0; x < img.cols; ++x) {
+			p[x][0] = saturate_cast<uchar>(p[x][0] * g[x]);
+			p[x][1] = saturate_cast<uchar>(p[x][1] * g[x]);
+			p[x][2] = saturate_cast<uchar>(p[x][2] * g[x]);
+		}
+	}
+}
+
+void PanoMaps::create(const std::vector<Mat> &_xmaps, const std::vector<Mat> &_ymaps, const std::vector<Mat> &masks,
+	const std::vector<Mat> &gainMaps, const std::vector<Point> &corners, Rect dstRoi, Rect crop, float sharpness) {
+	int n = _xmaps.size();
+	CV_Assert(_ymaps.size() == n && masks.size() == n && corners.size() == n && (gainMaps.empty() || gainMaps.size() == n));
+	clear();
+
+	// Feather weights of the blended result, same as cv::detail::FeatherBlender
+	std::vector<Mat> featherWeights(n);
+	std::vector<Rect> rcs(n);
+	Mat weightSum = Mat::zeros(dstRoi.size(), CV_32F);
+	for (int i = 0; i < n; ++i) {
+		Mat dist;
+		distanceTransform(masks[i], dist, DIST_L1, 3);
+		threshold(dist * sharpness, featherWeights[i], 1.f, 1.f, THRESH_TRUNC);
+		rcs[i] = Rect(corners[i] - dstRoi.tl(), masks[i].size());
+		Mat sumRoi = weightSum(rcs[i]);
+		add(sumRoi, featherWeights[i], sumRoi);
+	}
+
+	for (int i = 0; i < n; ++i) {
+		xmaps.push_back(Mat(crop.size(), CV_32F, Scalar(-1)));
+		ymaps.push_back(Mat(crop.size(), CV_32F, Scalar(-1)));
+		weights.push_back(Mat::zeros(crop.size(), CV_32F));
+		gains.push_back(Mat(crop.size(), CV_32F, Scalar(1)));
+		Rect inter = rcs[i] & crop;
+		if (inter.area() == 0) continue;
+		Rect inImg(inter.tl() - rcs[i].tl(), inter.size());
+		Rect inPano(inter.tl() - crop.tl(), inter.size());
+		_xmaps[i](inImg).copyTo(xmaps[i](inPano));
+		_ymaps[i](inImg).copyTo(ymaps[i](inPano));
+		if (!gainMaps.empty()) {
+			// Block gains are interpolated over the warped image, the same as the compensator applies them
+			Mat gainFull;
+			resize(gainMaps[i], gainFull, masks[i].size(), 0, 0, INTER_LINEAR);
+			gainFull(inImg).copyTo(gains[i](inPano));
+		}
+		Mat w = weights[i](inPano);
+		divide(featherWeights[i](inImg), weightSum(inter) + WEIGHT_EPS, w);
+	}
+	srcOffsets = std::vector<Point>(n);
+}
+
+void PanoCompositor::build(const std::vector<const PanoMaps*> &stages, const std::vector<std::vector<int>> &sources, int last,
+	Size _dstSz) {
+	layers.clear();
+	Size panoSz = stages[last]->size();
+	dstSz = _dstSz.area() > 0 ? _dstSz : panoSz;
+
+	// Start from the mapping of the panorama to the output, which is the identity if not scaled
+	double sx = panoSz.width * 1.0 / dstSz.width, sy = panoSz.height * 1.0 / dstSz.height;
+	Mat xmap(dstSz, CV_32F), ymap(dstSz, CV_32F);
+	for (int y = 0; y < dstSz.height; ++y) {
+		float *xrow = xmap.ptr<float>(y), *yrow = ymap.ptr<float>(y);
+		float v = static_cast<float>(min(max((y + 0.5) * sy - 0.5, 0.0), panoSz.height - 1.0));
+		for (int x = 0; x < dstSz.width; ++x) {
+			xrow[x] = static_cast<float>(min(max((x + 0.5) * sx - 0.5, 0.0), panoSz.width - 1.0));
+			yrow[x] = v;
+		}
+	}
+	expand(stages, sources, last, xmap, ymap, Mat::ones(dstSz, CV_32F), Mat::ones(dstSz, CV_32F));
+
+	// Renormalize, since weights are slightly off after interpolation
+	Mat weightSum = Mat::zeros(dstSz, CV_32F);
+	for (auto &l:layers) {
+		Mat sumRoi = weightSum(l.roi);
+		add(sumRoi, l.weight, sumRoi);
+	}
+	for (auto &l:layers) {
+		divide(l.weight, weightSum(l.roi) + WEIGHT_EPS, l.weight);
+		multiply(l.weight, l.gain, l.gainedWeight);
+	}
+	classifyColumns();
+}
+
+void PanoCompositor::classifyColumns() {
+	// A column is exclusive if only one layer reaches it, and covers all of it with full weight
+	std::vector<int> owner(dstSz.width, -1), touchCnt(dstSz.width, 0);
+	for (int i = 0; i < layers.size(); ++i) {
+		const Layer &l = layers[i];
+		for (int x = l.roi.x; x < l.roi.br().x; ++x) ++touchCnt[x];
+		if (l.roi.y != 0 || l.roi.height != dstSz.height) continue;
+		Mat colMin;
+		reduce(l.weight, colMin, 0, REDUCE_MIN);
+		for (int x = 0; x < l.roi.width; ++x) {
+			if (colMin.at<float>(0, x) >= 1.f - EXCLUSIVE_WEIGHT_EPS) owner[l.roi.x + x] = i;
+		}
+	}
+
+	segments.clear();
+	for (int x = 0; x < dstSz.width; ++x) {
+		int layerIdx = touchCnt[x] == 1 ? owner[x] : -1;
+		if (segments.empty() || segments.back().layerIdx != layerIdx) {
+			Segment seg = {Range(x, x), layerIdx};
+			segments.push_back(seg);
+		}
+		segments.back().cols.end = x + 1;
+	}
+}
+
+int PanoCompositor::bandCnt() const {
+	int cnt = 0;
+	for (auto &seg:segments) cnt += seg.layerIdx < 0;
+	return cnt;
+}
+
+void PanoCompositor::expand(const std::vector<const PanoMaps*> &stages, const std::vector<std::vector<int>> &sources,
+	int stageIdx, const Mat &xmap, const Mat &ymap, const Mat &weight, const Mat &gain) {
+	const PanoMaps &pm = *stages[stageIdx];
+	for (int i = 0; i < pm.xmaps.size(); ++i) {
+		Mat xi, yi, wi, gi, covered, valid;
+		remap(pm.xmaps[i], xi, xmap, ymap, INTER_LINEAR, BORDER_CONSTANT, Scalar(-1));
+		remap(pm.ymaps[i], yi, xmap, ymap, INTER_LINEAR, BORDER_CONSTANT, Scalar(-1));
+		remap(pm.weights[i], wi, xmap, ymap, INTER_LINEAR, BORDER_CONSTANT, Scalar(0));
+		// Gains of a stage scale its source images, so they chain multiplicatively down to the frames
+		remap(pm.gains[i], gi, xmap, ymap, INTER_LINEAR, BORDER_CONSTANT, Scalar(1));
+		multiply(gi, gain, gi);
+
+		// Interpolated coordinates only make sense where all neighbours are covered
+		erode(pm.weights[i] > 0, covered, Mat());
+		remap(covered, valid, xmap, ymap, INTER_NEAREST, BORDER_CONSTANT, Scalar(0));
+		multiply(wi, weight, wi);
+		wi.setTo(0, valid == 0);
+		if (countNonZero(wi) == 0) continue;
+
+		add(xi, Scalar(pm.srcOffsets[i].x), xi);
+		add(yi, Scalar(pm.srcOffsets[i].y), yi);
+		int src = sources[stageIdx][i];
+		if (src >= 0)
+			addLayer(src, xi, yi, wi, gi);
+		else
+			expand(stages, sources, -src - 1, xi, yi, wi, gi);
+	}
+}
+
+void PanoCompositor::addLayer(int frameIdx, const Mat &xmap, const Mat &ymap, const Mat &weight, const Mat &gain) {
+	std::vector<Point> nonZero;
+	findNonZero(weight > 0, nonZero);
+	Layer l;
+	l.frameIdx = frameIdx;
+	l.roi = boundingRect(nonZero);
+	convertMaps(xmap(l.roi), ymap(l.roi), l.map1, l.map2, CV_16SC2);
+	l.weight = weight(l.roi).clone();
+	l.gain = gain(l.roi).clone();
+	layers.push_back(l);
+}
+
+void PanoCompositor::compose(const std::vector<Mat> &frames, Mat &dst) {
+	acc.create(dstSz, CV_32FC3);
+	dst.create(dstSz, CV_8UC3);
+	for (auto &seg:segments) {
+		Rect rc(seg.cols.start, 0, seg.cols.size(), dstSz.height);
+		Mat dstRoi = dst(rc);
+		if (seg.layerIdx >= 0) {
+			// A plain copy of one frame, so it is remapped in place
+			const Layer &l = layers[seg.layerIdx];
+			Rect inLayer = rc - l.roi.tl();
+			remap(frames[l.frameIdx], dstRoi, l.map1(inLayer), l.map2(inLayer), INTER_LINEAR, BORDER_REFLECT);
+			applyGain(dstRoi, l.gain(inLayer));
+			continue;
+		}
+		Mat accBand = acc(rc);
+		accBand.setTo(Scalar::all(0));
+		for (auto &l:layers) {
+			Rect inter = l.roi & rc;
+			if (inter.area() == 0) continue;
+			Rect inLayer = inter - l.roi.tl();
+			remap(frames[l.frameIdx], warped, l.map1(inLayer), l.map2(inLayer), INTER_LINEAR, BORDER_REFLECT);
+			Mat accRoi = acc(inter);
+			accumulateWithWeights(warped, l.gainedWeight(inLayer), accRoi);
+		}
+		accBand.convertTo(dstRoi, CV_8U);
+	}
+}
@@ -0,0 +1,77 @@
+#include "..\Config.h"
+
+#pragma once
+namespace supp {
+	/* Backward maps from a stitched (and cropped) panorama to each of its source images, with normalized blending weights */
+	struct PanoMaps {
+		std::vector<Mat> xmaps, ymaps;	// CV_32F of panorama size, in source image coordinates
+		std::vector<Mat> weights;		// CV_32F of panorama size, sum to 1 where covered
+		std::vector<Mat> gains;			// CV_32F of panorama size, exposure gain of each source image
+		std::vector<Point> srcOffsets;	// Where each source image is cropped from, in the image it comes from
+
+		bool empty() const {return xmaps.empty();}
+		Size size() const {return xmaps.empty() ? Size() : xmaps[0].size();}
+		void clear() {xmaps.clear(); ymaps.clear(); weights.clear(); gains.clear(); srcOffsets.clear();}
+
+		/*
+			xmaps, ymaps: Backward maps of warped images, in source image coordinates
+			masks: Blending masks of warped images, placed at corners
+			gainMaps: Block gain maps of warped images (supp::ReusableBlocksGainCompensator), empty if not compensated
+			dstRoi: ROI of the blended result, crop: Area kept of it (relative to dstRoi)
+		*/
+		void create(const std::vector<Mat> &xmaps, const std::vector<Mat> &ymaps, const std::vector<Mat> &masks,
+			const std::vector<Mat> &gainMaps, const std::vector<Point> &corners, Rect dstRoi, Rect crop, float sharpness);
+	};
+
+	/*
+		Composition of chained stitching stages of a fixed geometry.
+		Each layer maps the final panorama back to one frame with a blending weight and the exposure gains of all stages,
+		so a new panorama is produced by one remap and accumulation per layer.
+		Columns covered by a single layer are remapped straight into the panorama, only blend bands are accumulated.
+	*/
+	class PanoCompositor {
+	public:
+		/* Source of a stage which is the output of another stage. Non-negative sources are frame indices */
+		static int fromStage(int stageIdx) {return -(stageIdx + 1);}
+
+		/*
+			sources[s][i] is where source image i of stage s comes from. Output of stage last is the panorama.
+			dstSz: Size of the composed panorama, that of stage last if empty. Scaling is folded into the layer maps
+		*/
+		void build(const std::vector<const PanoMaps*> &stages, const std::vector<std::vector<int>> &sources, int last,
+			Size dstSz = Size());
+		void compose(const std::vector<Mat> &frames, Mat &dst);
+
+		bool empty() const {return layers.empty();}
+		int layerCnt() const {return layers.size();}
+		int bandCnt() const;
+		Size size() const {return dstSz;}
+
+	private:
+		struct Layer {
+			int frameIdx;
+			Rect roi;			// Non-zero weight area in the panorama
+			Mat map1, map2;		// Fixed-point maps to the frame
+			Mat weight;
+			Mat gain;			// Product of gains of the stages the layer goes through
+			Mat gainedWeight;	// weight * gain, accumulated in blend bands
+		};
+
+		void expand(const std::vector<const PanoMaps*> &stages, const std::vector<std::vector<int>> &sources,
+			int stageIdx, const Mat &xmap, const Mat &ymap, const Mat &weight, const Mat &gain);
+		void addLayer(int frameIdx, const Mat &xmap, const Mat &ymap, const Mat &weight, const Mat &gain);
+		/* Split columns of the panorama into exclusive regions of one layer and blend bands */
+		void classifyColumns();
+
+		/* Columns of the panorama, either taken from one layer entirely or blended */
+		struct Segment {
+			Range cols;
+			int layerIdx;	// -1 for a blend band
+		};
+
+		Size dstSz;
+		std::vector<Layer> layers;
+		std::vector<Segment> segments;
+		Mat acc, warped;
+	};
+}
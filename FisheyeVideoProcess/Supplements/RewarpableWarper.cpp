@@ -1,4 +1,7 @@
 #include "RewarpableWarper.h"
+#if CV_SSE2
+	#include <emmintrin.h>
+#endif
 using namespace supp;
 
 void _ProjectorBase::setCameraParams(InputArray _K, InputArray _R, InputArray _T) {
@@ -16,6 +19,46 @@ void _ProjectorBase::setCameraParams(InputArray _K, InputArray _R, InputArray _T
 	system("pause");*/
 }
 
+void _ProjectorBase::mapBackwardBatch(
+	const float *sinu, const float *cosu, float a, float b, int n, float *x, float *y, bool divideByZ) const {
+	int i = 0;
+#if CV_SSE2
+	// 8 pixels per step
+	__m128 k[9];
+	for (int j=0; j<9; ++j) k[j] = _mm_set1_ps(k_rinv[j]);
+	const __m128 va = _mm_set1_ps(a), vb = _mm_set1_ps(b);
+	const __m128 zero = _mm_setzero_ps(), minus1 = _mm_set1_ps(-1.f);
+	for (; i <= n - 8; i += 8) {
+		for (int h = i; h < i + 8; h += 4) {
+			__m128 x_ = _mm_mul_ps(va, _mm_loadu_ps(sinu + h));
+			__m128 z_ = _mm_mul_ps(va, _mm_loadu_ps(cosu + h));
+			__m128 vx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(k[0], x_), _mm_mul_ps(k[1], vb)), _mm_mul_ps(k[2], z_));
+			__m128 vy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(k[3], x_), _mm_mul_ps(k[4], vb)), _mm_mul_ps(k[5], z_));
+			if (divideByZ) {
+				__m128 vz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(k[6], x_), _mm_mul_ps(k[7], vb)), _mm_mul_ps(k[8], z_));
+				__m128 pos = _mm_cmpgt_ps(vz, zero);
+				vx = _mm_div_ps(vx, vz);
+				vy = _mm_div_ps(vy, vz);
+				vx = _mm_or_ps(_mm_and_ps(pos, vx), _mm_andnot_ps(pos, minus1));
+				vy = _mm_or_ps(_mm_and_ps(pos, vy), _mm_andnot_ps(pos, minus1));
+			}
+			_mm_storeu_ps(x + h, vx);
+			_mm_storeu_ps(y + h, vy);
+		}
+	}
+#endif
+	for (; i < n; ++i) {
+		float x_ = a * sinu[i], y_ = b, z_ = a * cosu[i];
+		x[i] = k_rinv[0] * x_ + k_rinv[1] * y_ + k_rinv[2] * z_;
+		y[i] = k_rinv[3] * x_ + k_rinv[4] * y_ + k_rinv[5] * z_;
+		if (divideByZ) {
+			float z = k_rinv[6] * x_ + k_rinv[7] * y_ + k_rinv[8] * z_;
+			if (z > 0) { x[i] /= z; y[i] /= z; }
+			else x[i] = y[i] = -1;
+		}
+	}
+}
+
 void _ProjectorBase::autoSaveProjData() {
 	projData.push_back(getAllMats());
 	ttlProjTime = projData.size();
@@ -113,24 +156,52 @@ void RewarpableSphericalWarper::detectResultRoi(Size src_size, Point &dst_tl, Po
 }
 
 
-Point RewarpableSphericalWarper::warp(InputArray src, InputArray K, InputArray R, int interp_mode, int border_mode, OutputArray dst) {
-	UMat uxmap, uymap;
-	Rect dst_roi = buildMaps(src.size(), K, R, uxmap, uymap);
-
-	dst.create(dst_roi.height + 1, dst_roi.width + 1, src.type());
-	remap(src, dst, uxmap, uymap, interp_mode, border_mode);
-
-	return dst_roi.tl();
+int WarpMapsCache::hashcode(const std::vector<float> &key) {
+	int ret = 0;
+	for (auto f:key) hash_combine(ret, f);
+	return ret;
 }
 
-Point RewarpableCylindricalWarper::warp(InputArray src, InputArray K, InputArray R, int interp_mode, int border_mode, OutputArray dst) {
-	UMat uxmap, uymap;
-	Rect dst_roi = buildMaps(src.size(), K, R, uxmap, uymap);
+bool WarpMapsCache::find(const std::vector<float> &key, Entry &e) {
+	cv::AutoLock lock(mtx);
+	auto it = entries.find(hashcode(key));
+	if (it == entries.end() || it->second.key != key) {
+		missCnt++;
+		return false;
+	}
+	hitCnt++;
+	e = it->second;
+	touchCalib(e.calibId);
+	return true;
+}
 
-	dst.create(dst_roi.height + 1, dst_roi.width + 1, src.type());
-	remap(src, dst, uxmap, uymap, interp_mode, border_mode);
+void WarpMapsCache::insert(const Entry &e) {
+	cv::AutoLock lock(mtx);
+	int h = hashcode(e.key);
+	auto it = entries.find(h);
+	if (it != entries.end()) ttlBytes -= it->second.bytes();
+	entries[h] = e;
+	ttlBytes += e.bytes();
+	touchCalib(e.calibId);
+
+	// The calibration in use is kept even if it alone exceeds the bound
+	while (ttlBytes > WARP_MAPS_CACHE_MAX_BYTES && calibOrder.front() != e.calibId) {
+		int victim = calibOrder.front();
+		calibOrder.pop_front();
+		for (auto ie = entries.begin(); ie != entries.end();) {
+			if (ie->second.calibId == victim) {
+				ttlBytes -= ie->second.bytes();
+				ie = entries.erase(ie);
+			} else {
+				++ie;
+			}
+		}
+	}
+}
 
-	return dst_roi.tl();
+void WarpMapsCache::touchCalib(int calibId) {
+	calibOrder.remove(calibId);
+	calibOrder.push_back(calibId);
 }
 
 void _ProjectorBase::getAverRotationMatrix(std::vector<Mat> &rots, Mat & ret) {
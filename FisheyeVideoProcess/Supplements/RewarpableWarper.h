@@ -1,6 +1,9 @@
 #include "..\Config.h"
 #include <opencv2\stitching\detail\warpers.hpp>
 #include <opencv2\stitching.hpp>
+#include <unordered_map>
+#include <deque>
+#include <list>
 
 #pragma once
 
@@ -51,6 +54,40 @@ namespace supp{
 	};
 
 
+	/* 
+		Memorization of warping maps across frames, keyed by projector state and source size.
+		Bounded by bytes. Maps are evicted by calibration, the least recently used one first, since a frame needs all maps of it.
+		Thread-safe. Entries are copied in and out (Mat data is shared), so eviction never invalidates one in use.
+	*/
+	struct WarpMapsCache {
+#define WARP_MAPS_CACHE_MAX_BYTES (size_t(384) << 20)	/* About the working set of a STITCH_DOUBLE_SIDE group at compose scale */
+		struct Entry {
+			std::vector<float> key;
+			int calibId;	// Hash of projector data the maps are built from
+			Rect dstRoi;
+			Mat xmap, ymap;
+			Mat mask;	// Warped all-255 mask of the source size, built on demand
+			size_t bytes() const {
+				return xmap.total()*xmap.elemSize() + ymap.total()*ymap.elemSize() + mask.total()*mask.elemSize();
+			}
+		};
+		std::unordered_map<int, Entry> entries;
+		std::list<int> calibOrder;	// Least recently used calibration first
+		size_t ttlBytes;
+		int hitCnt, missCnt;
+
+		WarpMapsCache(){clear();}
+		void clear() {cv::AutoLock lock(mtx); entries.clear(); calibOrder.clear(); ttlBytes = 0; hitCnt = missCnt = 0;}
+		static int hashcode(const std::vector<float> &key);
+		/* Return false if the key has not been seen */
+		bool find(const std::vector<float> &key, Entry &e);
+		/* Add or replace the entry of e.key. Calibrations other than e.calibId are evicted while over WARP_MAPS_CACHE_MAX_BYTES */
+		void insert(const Entry &e);
+	private:
+		cv::Mutex mtx;
+		void touchCalib(int calibId);
+	};
+
 /* The following structs/classes are intended to append rewarp-ability to the original cv warper*/
 
 // Spherical, Cylinderical, Mercator
@@ -90,6 +127,21 @@ namespace supp{
 			pltHelper.transformBackward(x,y,u,v);
 		}
 
+		/*
+			Batch backward mapping. Unit directions of all projectors here are in the form of
+			(a*sin(u), b, a*cos(u)), where u only depends on column and a,b only depend on row,
+			so the transcendental parts are calculated once per column and once per row.
+		*/
+		inline void mapBackwardCol(float u, float &sinu, float &cosu) {
+			float v;
+			_ProjectorBase::mapBackward(u,0,u,v);
+			u /= scale;
+			sinu = sinf(u);
+			cosu = cosf(u);
+		}
+		void mapBackwardBatch(
+			const float *sinu, const float *cosu, float a, float b, int n, float *x, float *y, bool divideByZ) const;
+
 		static void getAverRotationMatrix(std::vector<Mat> &rots, Mat & ret);
 		static std::vector<float> reCalcCameraParamsAndGetAllMats(
 			float scale,
@@ -130,6 +182,14 @@ namespace supp{
 			if (z > 0) { x /= z; y /= z;}
 			else x = y = -1;
 		}
+
+		inline void mapBackwardRow(float v, const float *sinu, const float *cosu, int n, float *x, float *y) {
+			float u;
+			_ProjectorBase::mapBackward(0,v,u,v);
+			v /= scale;
+			float sinv = sinf(static_cast<float>(CV_PI) - v);
+			mapBackwardBatch(sinu, cosu, sinv, cosf(static_cast<float>(CV_PI) - v), n, x, y, true);
+		}
 	};
 
 	template <class P>
@@ -142,7 +202,10 @@ namespace supp{
 
 		std::vector<PlaneLinearTransformHelper> plts;
 		int curBuildMapsTime;
-		RewarpableRotationWarperBase():curBuildMapsTime(INT_MAX),curImageIdx(-1){}
+		RewarpableRotationWarperBase():curBuildMapsTime(INT_MAX),curImageIdx(-1),pMapsCache(NULL),calibId(0){}
+
+		/* Maps are kept in pMapsCache if set, so that they can be reused by later warpers */
+		void setMapsCache(WarpMapsCache *_pMapsCache) {pMapsCache = _pMapsCache;}
 
 		void setPLTs(std::vector<PlaneLinearTransformHelper>& _plts) {plts.assign(_plts.begin(), _plts.end());curBuildMapsTime = 0;}
 
@@ -153,9 +216,12 @@ namespace supp{
 			}
 
 			std::vector<std::vector<float>> d = std::vector<std::vector<float>>(dmat.rows, std::vector<float>(dmat.cols));
+			calibId = 0;
 			for (int i=0; i<dmat.rows; ++i)
-				for (int j=0; j<dmat.cols; ++j)
-					 d[i][j] = dmat.at<float>(i,j);
+				for (int j=0; j<dmat.cols; ++j) {
+					d[i][j] = dmat.at<float>(i,j);
+					hash_combine(calibId, d[i][j]);
+				}
 			projector_.setAllMatsMultiple(d);
 		}
 		Mat getProjectorAllData() {
@@ -169,6 +235,91 @@ namespace supp{
 
 		std::vector<ResultRoi> getResultRoiData() {return resultRoiData;}	
 
+		Rect buildMaps(Size src_size, InputArray K, InputArray R, OutputArray xmap, OutputArray ymap) {
+			WarpMapsCache::Entry *e = fetchMaps(src_size, K, R);
+			e->xmap.copyTo(xmap);
+			e->ymap.copyTo(ymap);
+			return e->dstRoi;
+		}
+
+		Point warp(InputArray src, InputArray K, InputArray R, int interp_mode, int border_mode, OutputArray dst) {
+			WarpMapsCache::Entry *e = fetchMaps(src.size(), K, R);
+			dst.create(e->dstRoi.height + 1, e->dstRoi.width + 1, src.type());
+			remap(src, dst, e->xmap, e->ymap, interp_mode, border_mode);
+			return e->dstRoi.tl();
+		}
+
+		/*
+			Same projector replay as warp(), but returns the maps instead of remapping,
+			so pixels can be remapped elsewhere (e.g. in parallel). Maps may be shared with the cache, do not modify them.
+		*/
+		WarpMapsCache::Entry getMaps(Size src_size, InputArray K, InputArray R) {
+			return *fetchMaps(src_size, K, R);
+		}
+
+		/* Same projector replay as warp() or warpMask(), but only the ROI is detected, without any mapping */
+		Rect replayRoi(Size src_size, InputArray K, InputArray R) {
+			projector_.setCameraParams(K, R);
+			Point dst_tl, dst_br;
+			detectResultRoi(src_size, dst_tl, dst_br);
+			return Rect(dst_tl, dst_br);
+		}
+
+		/* Same as warping an all-255 CV_8U mask of src_size with INTER_NEAREST and BORDER_CONSTANT */
+		Point warpMask(Size src_size, InputArray K, InputArray R, OutputArray dst) {
+			WarpMapsCache::Entry *e = fetchMaps(src_size, K, R);
+			if (e->mask.empty()) {
+				Mat mask(src_size, CV_8U, Scalar::all(255));
+				remap(mask, e->mask, e->xmap, e->ymap, INTER_NEAREST, BORDER_CONSTANT);
+				if (pMapsCache != NULL) pMapsCache->insert(*e);
+			}
+			e->mask.copyTo(dst);
+			return e->dstRoi.tl();
+		}
+
+	protected:
+		WarpMapsCache *pMapsCache;
+		WarpMapsCache::Entry localMaps;	// Maps in use, copied from or to pMapsCache
+		int calibId;	// Of projector data by setProjectorData(), maps are evicted from pMapsCache by it
+
+		/* 
+			Projector params and ROI are always updated as cv::detail::RotationWarperBase::buildMaps does,
+			since projData, plts and resultRoiData rely on the calling sequence. Only mapping is skipped if cached.
+		*/
+		WarpMapsCache::Entry* fetchMaps(Size src_size, InputArray K, InputArray R) {
+			Rect roi = replayRoi(src_size, K, R);
+			Point dst_tl = roi.tl(), dst_br = roi.br();
+
+			std::vector<float> key = projector_.getAllMats();
+			key.push_back(projector_.pltHelper.ax); key.push_back(projector_.pltHelper.bx);
+			key.push_back(projector_.pltHelper.ay); key.push_back(projector_.pltHelper.by);
+			key.push_back(src_size.width); key.push_back(src_size.height);
+			key.push_back(dst_tl.x); key.push_back(dst_tl.y);
+			key.push_back(dst_br.x); key.push_back(dst_br.y);
+
+			WarpMapsCache::Entry *e = &localMaps;
+			if (pMapsCache != NULL && pMapsCache->find(key, *e)) return e;
+
+			e->key = key;
+			e->calibId = calibId;
+			e->dstRoi = Rect(dst_tl, dst_br);
+			Size dsize(dst_br.x - dst_tl.x + 1, dst_br.y - dst_tl.y + 1);
+			// New buffers, since former ones may be shared with the cache
+			e->xmap = Mat(dsize, CV_32F);
+			e->ymap = Mat(dsize, CV_32F);
+			e->mask.release();
+			std::vector<float> sinu(dsize.width), cosu(dsize.width);
+			for (int u = dst_tl.x; u <= dst_br.x; ++u)
+				projector_.mapBackwardCol(static_cast<float>(u), sinu[u - dst_tl.x], cosu[u - dst_tl.x]);
+			for (int v = dst_tl.y; v <= dst_br.y; ++v) {
+				projector_.mapBackwardRow(static_cast<float>(v), &sinu[0], &cosu[0], dsize.width,
+					e->xmap.ptr<float>(v - dst_tl.y), e->ymap.ptr<float>(v - dst_tl.y));
+			}
+			if (pMapsCache != NULL) pMapsCache->insert(*e);
+			return e;
+		}
+	public:
+
 	    void detectResultRoi(Size src_size, Point &dst_tl, Point &dst_br) {
 			if (curBuildMapsTime < plts.size()) {
 				projector_.pltHelper = plts[curBuildMapsTime]; 
@@ -194,11 +345,6 @@ namespace supp{
 	class RewarpableSphericalWarper : public RewarpableRotationWarperBase<_SphericalProjector> {
 	public:
 		RewarpableSphericalWarper(float scale) {projector_.scale = scale;}
-		//Rect buildMaps(Size src_size, InputArray K, InputArray R, OutputArray xmap, OutputArray ymap) {
-		//	return RewarpableRotationWarperBase<_SphericalProjector>::buildMaps(src_size,K,R,xmap,ymap);
-		//}
-
-		Point warp(InputArray src, InputArray K, InputArray R, int interp_mode, int border_mode, OutputArray dst);
 	protected:
 		void detectResultRoi(Size src_size, Point &dst_tl, Point &dst_br);
 	};
@@ -230,6 +376,13 @@ namespace supp{
 			if (z > 0) { x /= z; y /= z; }
 			else x = y = -1;
 		}
+
+		inline void mapBackwardRow(float v, const float *sinu, const float *cosu, int n, float *x, float *y) {
+			float u;
+			_ProjectorBase::mapBackward(0,v,u,v);
+			v /= scale;
+			mapBackwardBatch(sinu, cosu, 1.f, v, n, x, y, true);
+		}
 	};
 
 
@@ -237,11 +390,6 @@ namespace supp{
 	public:
 		RewarpableCylindricalWarper(float scale) { projector_.scale = scale; }
 
-		//Rect buildMaps(Size src_size, InputArray K, InputArray R, OutputArray xmap, OutputArray ymap) {
-		//	return RewarpableRotationWarperBase<_CylindricalProjector>::buildMaps(src_size,K,R,xmap,ymap);
-		//}
-
-		Point warp(InputArray src, InputArray K, InputArray R, int interp_mode, int border_mode, OutputArray dst);
 	protected:
 		void detectResultRoi(Size src_size, Point &dst_tl, Point &dst_br) {
 			RewarpableRotationWarperBase<_CylindricalProjector>::detectResultRoiByBorder(src_size, dst_tl, dst_br);
@@ -280,6 +428,14 @@ namespace supp{
 			y = k_rinv[3] * x_ + k_rinv[4] * y_ + k_rinv[5] * z_;
 			z = k_rinv[6] * x_ + k_rinv[7] * y_ + k_rinv[8] * z_;
 		}
+
+		inline void mapBackwardRow(float v, const float *sinu, const float *cosu, int n, float *x, float *y) {
+			float u;
+			_ProjectorBase::mapBackward(0,v,u,v);
+			v /= scale;
+			float v_ = atanf( sinhf(v) );
+			mapBackwardBatch(sinu, cosu, cosf(v_), sinf(v_), n, x, y, false);
+		}
 	};
 
 
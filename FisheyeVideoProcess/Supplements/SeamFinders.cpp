@@ -0,0 +1,107 @@
+#include "SeamFinders.h"
+#include <algorithm>
+using namespace supp;
+
+#define DP_SEAM_UNCOVERED_COST 765.f	// Cost of a pixel not covered by both images, the max of color difference
+
+void TemporalDpSeamFinder::findInPair(size_t first, size_t second, Rect roi) {
+	Mat img1 = images_[first].getMat(ACCESS_READ), img2 = images_[second].getMat(ACCESS_READ);
+	Mat mask1 = masks_[first].getMat(ACCESS_RW), mask2 = masks_[second].getMat(ACCESS_RW);
+	CV_Assert(img1.type() == CV_8UC3 && img2.type() == CV_8UC3);
+	Point tl1 = roi.tl() - corners_[first], tl2 = roi.tl() - corners_[second];
+	std::pair<int,int> key(static_cast<int>(first), static_cast<int>(second));
+	auto pre = prePaths_.find(key);
+	const SeamPath *prePath = pre == prePaths_.end() ? NULL : &pre->second;
+
+	// Accumulated cost of the cheapest path reaching each pixel from the top, and the column it comes from
+	int w = roi.width, h = roi.height;
+	Mat_<float> energy(h, w);
+	Mat_<schar> step(h, w);
+	for (int y = 0; y < h; ++y) {
+		const Vec3b *p1 = img1.ptr<Vec3b>(tl1.y + y) + tl1.x, *p2 = img2.ptr<Vec3b>(tl2.y + y) + tl2.x;
+		const uchar *m1 = mask1.ptr<uchar>(tl1.y + y) + tl1.x, *m2 = mask2.ptr<uchar>(tl2.y + y) + tl2.x;
+		const float *ePre = y > 0 ? energy[y-1] : NULL;
+		float *e = energy[y];
+		schar *s = step[y];
+		int preRow = roi.y + y - (prePath ? prePath->top : 0);
+		bool hasPre = prePath && preRow >= 0 && preRow < static_cast<int>(prePath->xs.size());
+		int preX = hasPre ? prePath->xs[preRow] - roi.x : 0;
+		for (int x = 0; x < w; ++x) {
+			float cost = DP_SEAM_UNCOVERED_COST;
+			if (m1[x] && m2[x])
+				cost = static_cast<float>(abs(p1[x][0] - p2[x][0]) + abs(p1[x][1] - p2[x][1]) + abs(p1[x][2] - p2[x][2]));
+			if (hasPre) cost += temporalPenalty_ * abs(x - preX);
+			s[x] = 0;
+			if (ePre) {
+				float best = ePre[x];
+				if (x > 0 && ePre[x-1] < best) best = ePre[x-1], s[x] = -1;
+				if (x < w-1 && ePre[x+1] < best) best = ePre[x+1], s[x] = 1;
+				cost += best;
+			}
+			e[x] = cost;
+		}
+	}
+
+	SeamPath &path = paths_[key];
+	path.top = roi.y;
+	path.xs.resize(h);
+	int x = static_cast<int>(std::min_element(energy[h-1], energy[h-1] + w) - energy[h-1]);
+	for (int y = h-1; y >= 0; --y) {
+		path.xs[y] = roi.x + x;
+		x += step(y, x);
+	}
+
+	// The image whose center is on the left keeps the pixels up to the seam. Pixels of only one image are kept
+	bool isFirstLeft = corners_[first].x * 2 + sizes_[first].width <= corners_[second].x * 2 + sizes_[second].width;
+	Mat &maskL = isFirstLeft ? mask1 : mask2, &maskR = isFirstLeft ? mask2 : mask1;
+	Point tlL = isFirstLeft ? tl1 : tl2, tlR = isFirstLeft ? tl2 : tl1;
+	for (int y = 0; y < h; ++y) {
+		uchar *mL = maskL.ptr<uchar>(tlL.y + y) + tlL.x, *mR = maskR.ptr<uchar>(tlR.y + y) + tlR.x;
+		int seamX = path.xs[y] - roi.x;
+		for (int x = 0; x <= seamX; ++x)
+			if (mL[x]) mR[x] = 0;
+		for (int x = seamX + 1; x < w; ++x)
+			if (mR[x]) mL[x] = 0;
+	}
+}
+
+double supp::seamCost(const std::vector<UMat> &images, const std::vector<Point> &corners, const std::vector<UMat> &masks) {
+	double ttl = 0;
+	int cnt = 0;
+	for (int i = 0; i < images.size(); ++i) {
+		for (int j = i + 1; j < images.size(); ++j) {
+			Rect roi = Rect(corners[i], masks[i].size()) & Rect(corners[j], masks[j].size());
+			if (roi.width < 2) continue;
+			Mat imgI = images[i].getMat(ACCESS_READ), imgJ = images[j].getMat(ACCESS_READ);
+			Mat maskI = masks[i].getMat(ACCESS_READ), maskJ = masks[j].getMat(ACCESS_READ);
+			Point tlI = roi.tl() - corners[i], tlJ = roi.tl() - corners[j];
+			for (int y = 0; y < roi.height; ++y) {
+				const Vec3b *pI = imgI.ptr<Vec3b>(tlI.y + y) + tlI.x, *pJ = imgJ.ptr<Vec3b>(tlJ.y + y) + tlJ.x;
+				const uchar *mI = maskI.ptr<uchar>(tlI.y + y) + tlI.x, *mJ = maskJ.ptr<uchar>(tlJ.y + y) + tlJ.x;
+				for (int x = 0; x + 1 < roi.width; ++x) {
+					const Vec3b *a, *b;
+					if (mI[x] && !mJ[x] && mJ[x+1] && !mI[x+1]) a = &pI[x], b = &pJ[x+1];
+					else if (mJ[x] && !mI[x] && mI[x+1] && !mJ[x+1]) a = &pJ[x], b = &pI[x+1];
+					else continue;
+					ttl += (abs((*a)[0] - (*b)[0]) + abs((*a)[1] - (*b)[1]) + abs((*a)[2] - (*b)[2])) / 3.0;
+					++cnt;
+				}
+			}
+		}
+	}
+	return cnt == 0 ? 0 : ttl / cnt;
+}
+
+double supp::seamFlicker(const std::vector<UMat> &masks, const std::vector<UMat> &refMasks) {
+	if (masks.size() != refMasks.size()) return -1;
+	double changed = 0, ttl = 0;
+	for (int i = 0; i < masks.size(); ++i) {
+		if (masks[i].size() != refMasks[i].size()) return -1;
+		UMat diff;
+		bitwise_xor(masks[i], refMasks[i], diff);
+		// A pixel changing its owner is counted in both masks
+		changed += countNonZero(diff) / 2.0;
+		ttl += countNonZero(masks[i]);
+	}
+	return ttl == 0 ? 0 : changed / ttl;
+}
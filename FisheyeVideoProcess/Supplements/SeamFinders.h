@@ -0,0 +1,39 @@
+#include "..\Config.h"
+#include <map>
+#include <opencv2\stitching\detail\seam_finders.hpp>
+
+#pragma once
+namespace supp {
+	/* Vertical seam of an overlap, xs[i] is the last column of the left image in row top+i, in panorama coordinates */
+	struct SeamPath {
+		int top;
+		std::vector<int> xs;
+		SeamPath():top(0){}
+	};
+	/* Seams of each overlapped image pair */
+	typedef std::map<std::pair<int,int>, SeamPath> SeamPaths;
+
+	/*
+		Seam finder taking the cheapest vertical path through each overlap by dynamic programming,
+		on the color difference of CV_8UC3 images. Moving away from the seam of the former frame costs
+		temporalPenalty per pixel per row, so that seams don't jump between frames of similar content.
+	*/
+	class TemporalDpSeamFinder : public cv::detail::PairwiseSeamFinder {
+	public:
+		TemporalDpSeamFinder(float temporalPenalty, const SeamPaths &prePaths = SeamPaths())
+			:temporalPenalty_(temporalPenalty), prePaths_(prePaths) {}
+
+		const SeamPaths& getPaths() const {return paths_;}
+
+	private:
+		void findInPair(size_t first, size_t second, Rect roi);
+
+		float temporalPenalty_;
+		SeamPaths prePaths_, paths_;
+	};
+
+	/* Mean abs diff (0-255) between horizontally adjacent pixels of different images across seams, the lower the less visible */
+	double seamCost(const std::vector<UMat> &images, const std::vector<Point> &corners, const std::vector<UMat> &masks);
+	/* Fraction of pixels whose owner differs from that of refMasks, found at the same corners. -1 if their sizes differ */
+	double seamFlicker(const std::vector<UMat> &masks, const std::vector<UMat> &refMasks);
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include "Config.h"		
 #include "StitchingUtil.h"
+#include "Processor.h"
 #include "OtherUtils\ImageUtil.h"
 #include "Supplements\RewarpableWarper.h"
 #include "OtherUtils\FileUtil.h"
@@ -71,5 +72,41 @@ public:
 		FileUtil::decompress(TEMP_PATH+std::string("58e6f398_24M58e6f398241.bin"));
 	}
 
+	/* Registration benchmark of each FeaturesTier */
+	void test6() {
+		LocalStitchingInfoGroup lsig;
+		Processor p(&lsig);
+		std::string oriSrc[] = {
+			RESOURCE_PATH + (std::string)"front.mp4",
+			RESOURCE_PATH + (std::string)"back.mp4"
+		};
+		p.setPaths(oriSrc, sizeof(oriSrc)/sizeof(std::string), OUTPUT_PATH + (std::string)"benchmark.avi");
+		p.benchmarkRegistration(3, 0);
+	}
+
+	/* Seam benchmark of each SeamFinderType */
+	void test7() {
+		LocalStitchingInfoGroup lsig;
+		Processor p(&lsig);
+		std::string oriSrc[] = {
+			RESOURCE_PATH + (std::string)"front.mp4",
+			RESOURCE_PATH + (std::string)"back.mp4"
+		};
+		p.setPaths(oriSrc, sizeof(oriSrc)/sizeof(std::string), OUTPUT_PATH + (std::string)"benchmark.avi");
+		p.benchmarkSeams(3, 0);
+	}
+
+	/* Single-pass composing against stage-by-stage composing */
+	void test8() {
+		LocalStitchingInfoGroup lsig;
+		Processor p(&lsig);
+		std::string oriSrc[] = {
+			RESOURCE_PATH + (std::string)"front.mp4",
+			RESOURCE_PATH + (std::string)"back.mp4"
+		};
+		p.setPaths(oriSrc, sizeof(oriSrc)/sizeof(std::string), OUTPUT_PATH + (std::string)"benchmark.avi");
+		p.checkSinglePass(3, 0);
+	}
+
 
 };
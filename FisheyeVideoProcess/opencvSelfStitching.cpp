@@ -2,6 +2,10 @@
 #include "OtherUtils\ImageUtil.h"
 #include "Supplements\Matchers.h"
 #include "Supplements\RewarpableWarper.h"
+#include "Supplements\ExposureCompensators.h"
+#include "Supplements\Blenders.h"
+#include "Supplements\SeamFinders.h"
+#include <functional>
 
 #define USE_WARPER_TYPE 0		// 0->Cyl   1->Mer   2->Sph
 
@@ -17,33 +21,130 @@
 #endif
 
 using namespace cv::detail;
+
+/* Per-image loop body for cv::parallel_for_. Each index only writes its own outputs, so results do not depend on scheduling */
+class ParallelForEachImage : public ParallelLoopBody {
+public:
+	ParallelForEachImage(const std::function<void(int)> &_body):body(_body){}
+	void operator()(const Range &range) const {
+		for (int i = range.start; i < range.end; ++i) body(i);
+	}
+private:
+	std::function<void(int)> body;
+};
+
+static void parallelForEachImage(int imgCnt, const std::function<void(int)> &body) {
+	parallel_for_(Range(0, imgCnt), ParallelForEachImage(body));
+}
+
+/* Features finder of the registration tier in osp, keeping at most maxKeypoints (0 if unlimited) per call */
+static Ptr<FeaturesFinder> createFeaturesFinder(const OpenCVStitchParam &osp, int maxKeypoints) {
+	switch (osp.featuresTier) {
+	case FEATURES_AKAZE:
+		return makePtr<supp::AKAZEFeaturesFinder>(AKAZE::DESCRIPTOR_MLDB, 0, 3, 0.001f, 4, 4, KAZE::DIFF_PM_G2, maxKeypoints);
+	case FEATURES_ORB:
+		return makePtr<OrbFeaturesFinder>(Size(3,1), maxKeypoints);
+	default:
+		return makePtr<supp::SIFTFeaturesFinder>(maxKeypoints);
+	}
+}
+
+/* Size of the result of ImageUtil::resize(src, dst, Size(), scale, scale) */
+static Size scaledSize(Size sz, double scale) {
+	return Size(saturate_cast<int>(sz.width * scale), saturate_cast<int>(sz.height * scale));
+}
+
+/*
+	Features of the overlap strips rois (in work scale image coordinates) only.
+	Each strip is cropped from the full image and resized on its own,
+	so neither the resize nor the detector touches the rest of the image.
+*/
+static void findStripFeatures(FeaturesFinder &finder, const Mat &fullImg, double workScale,
+	const std::vector<Rect> &rois, ImageFeatures &features) {
+	Mat descriptors;
+	features.img_size = scaledSize(fullImg.size(), workScale);
+	features.keypoints.clear();
+	for (auto &roi:rois) {
+		Rect fullRoi(Point(cvRound(roi.x / workScale), cvRound(roi.y / workScale)),
+			Point(cvRound(roi.br().x / workScale), cvRound(roi.br().y / workScale)));
+		fullRoi &= Rect(Point(), fullImg.size());
+		if (roi.area() == 0 || fullRoi.area() == 0) continue;
+
+		Mat strip;
+		ImageFeatures stripFeatures;
+		ImageUtil::resize(fullImg(fullRoi), strip, roi.size());
+		finder(strip, stripFeatures);
+		for (auto kp:stripFeatures.keypoints) {
+			kp.pt.x += roi.x;
+			kp.pt.y += roi.y;
+			features.keypoints.push_back(kp);
+		}
+		descriptors.push_back(stripFeatures.descriptors.getMat(ACCESS_READ));
+	}
+	descriptors.copyTo(features.descriptors);
+}
+
+/* Largest change between two sets of cameras, of focals (relative) and rotation elements */
+static double camerasDelta(const std::vector<CameraParams> &a, const std::vector<CameraParams> &b) {
+	double delta = 0;
+	for (int i = 0; i < a.size(); ++i) {
+		delta = max(delta, abs(a[i].focal - b[i].focal) / a[i].focal);
+		delta = max(delta, norm(a[i].R, b[i].R, NORM_INF));
+	}
+	return delta;
+}
+
+/*
+	Bundle adjustment starting from the given cameras, run WARM_BA_CHUNK_ITERS iterations at a time
+	until cameras converge or the iteration or time budget of osp is used up. Return false if it failed
+*/
+static bool warmBundleAdjust(BundleAdjusterBase &adjuster, const OpenCVStitchParam &osp,
+	std::vector<ImageFeatures> &features, std::vector<MatchesInfo> &pairwise_matches, std::vector<CameraParams> &cameras) {
+	int64 start = getTickCount();
+	int iters = 0;
+	double elapsedMs = 0, delta = DBL_MAX;
+	while (iters < osp.warmBAMaxIters && elapsedMs < osp.warmBAMaxMs && delta >= osp.warmBAEps) {
+		int chunk = min(WARM_BA_CHUNK_ITERS, osp.warmBAMaxIters - iters);
+		std::vector<CameraParams> pre = cameras;
+		adjuster.setTermCriteria(TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, chunk, DBL_EPSILON));
+		if (!adjuster(features, pairwise_matches, cameras)) return false;
+		iters += chunk;
+		delta = camerasDelta(pre, cameras);
+		elapsedMs = (getTickCount() - start) * 1000.0 / getTickFrequency();
+	}
+	LOG_MESS("Warm started bundle adjustment: " << iters << " iterations, " << elapsedMs << " ms, last change " << delta);
+	return true;
+}
+
 StitchingInfo StitchingUtil::opencvSelfStitching(
 	const std::vector<Mat> &srcs, Mat &dstImage, StitchingInfo &sInfo, std::pair<double, double> &maskRatio) {
-		Size sz = srcs[0].size();
-		if (sInfo.isNull()) {
-			for (auto src:srcs) {
-				if (src.size().area() < sz.area()) sz = src.size();
-			}
-		}
-		return opencvSelfStitching(srcs,dstImage, sz, sInfo, maskRatio);
+		return opencvSelfStitching(srcs, dstImage, Size(), sInfo, osParam, maskRatio);
+}
+
+StitchingInfo StitchingUtil::opencvSelfStitching(
+	const std::vector<Mat> &srcs, Mat &dstImage, const Size resizeSz, StitchingInfo &sInfo, std::pair<double, double> &maskRatio) {
+		return opencvSelfStitching(srcs, dstImage, resizeSz, sInfo, osParam, maskRatio);
 }
 
 
 StitchingInfo StitchingUtil::opencvSelfStitching(
-	const std::vector<Mat> &srcs, Mat &dstImage, const Size resizeSz,StitchingInfo &sInfoNotNull, std::pair<double, double> &maskRatio) {
+	const std::vector<Mat> &srcs, Mat &dstImage, Size resizeSz,StitchingInfo &sInfoNotNull, const OpenCVStitchParam &osp, std::pair<double, double> &maskRatio,
+	const std::vector<CameraParams> &warmCameras) {
 	StitchingInfo sInfo;
+	if (resizeSz.area() == 0) {
+		resizeSz = srcs[0].size();
+		for (auto src:srcs) {
+			if (src.size().area() < resizeSz.area()) resizeSz = src.size();
+		}
+	}
 
 	double work_scale = 1, seam_scale = 1, compose_scale = 1;
 	double seam_work_aspect = 1;
-	Mat full_img1,full_img, img;
-	int imgCnt = srcs.size(); 
+	int imgCnt = srcs.size();
 	float warped_image_scale;
 	std::vector<CameraParams> cameras;
 	std::vector<Mat> images(imgCnt);
-	std::vector<Size> full_img_sizes(imgCnt);
 
-	Ptr<FeaturesFinder> finder;
-	finder = new supp::SIFTFeaturesFinder();
 	std::vector<ImageFeatures> features(imgCnt);
 	std::vector<MatchesInfo> pairwise_matches;
 	HomographyBasedEstimator estimator;
@@ -55,77 +156,65 @@ StitchingInfo StitchingUtil::opencvSelfStitching(
 		sInfo.maskRatio = sInfoNotNull.maskRatio;
 		sInfo.resizeSz = sInfoNotNull.resizeSz;
 		sInfo.srcType = sInfoNotNull.srcType;
-		for (int i = 0; i < imgCnt; ++i) {
-			full_img1 = srcs[i].clone();
-			//LOG_WARN("Orig Size:" << full_img1.size());
-			//assert(full_img1.size().width >= resizeSz[i].width && full_img1.size().height >= resizeSz[i].height);
-			ImageUtil::resize(full_img1,full_img, sInfo.resizeSz,0,0);
-			full_img_sizes[i] = full_img.size();
-			work_scale = min(1.0, sqrt(osParam.workMegapix * 1e6 / full_img.size().area()));
-			ImageUtil::resize(full_img, img, Size(), work_scale, work_scale);
-			seam_scale = min(1.0, sqrt(osParam.seamMegapix * 1e6 / full_img.size().area()));
-			seam_work_aspect = seam_scale / work_scale;
-			ImageUtil::resize(full_img, img, Size(), seam_scale, seam_scale);
-			images[i] = img.clone();
-		}
-		sInfoNotNull.setToCamerasInternalParam(cameras);
-		warped_image_scale = sInfoNotNull.getWarpScale();
-
 	} else {
-
 		sInfo.imgCnt = imgCnt;
 		sInfo.maskRatio = maskRatio;
 		sInfo.resizeSz = resizeSz;
 		sInfo.srcType = srcs[0].type();
+	}
+
+	// All sources are resized to sInfo.resizeSz, so the scales are the same for each image
+	work_scale = min(1.0, sqrt(osp.workMegapix * 1e6 / sInfo.resizeSz.area()));
+	seam_scale = min(1.0, sqrt(osp.seamMegapix * 1e6 / sInfo.resizeSz.area()));
+	seam_work_aspect = seam_scale / work_scale;
+	// Features are only found without a given calibration. They are not cached across calls, since each frame
+	// is registered once, and re-estimation (e.g. adjustPltForLSIG) passes the averaged calibration instead
+	bool isFindFeatures = sInfoNotNull.isNull();
+	// Estimation of the final stage needs no pixels after features
+	bool isGeometryOnly = !osp.isRealStitching && osp.isGeometryOnly;
+
+	if (isFindFeatures)
 		LOG_MESS("Finding features... with MaskRatio (" << sInfo.maskRatio.first << "," << sInfo.maskRatio.second <<")");
-		for (int i = 0; i < imgCnt; ++i) {
-			full_img1 = srcs[i].clone();
-			//LOG_WARN("Orig Size:" << full_img1.size());
-			//assert(full_img1.size().width >= resizeSz[i].width && full_img1.size().height >= resizeSz[i].height);
-			ImageUtil::resize(full_img1,full_img, sInfo.resizeSz, 0,0);
-			full_img_sizes[i] = full_img.size();
-			work_scale = min(1.0, sqrt(osParam.workMegapix * 1e6 / full_img.size().area()));
-
-			ImageUtil::resize(full_img, img, Size(), work_scale, work_scale);
-			seam_scale = min(1.0, sqrt(osParam.seamMegapix * 1e6 / full_img.size().area()));
-			seam_work_aspect = seam_scale / work_scale;
-			(*finder)(img, features[i],StitchingUtil::getMaskROI(img, i,imgCnt, sInfo.maskRatio));
-			//LOG_MESS(features[i].keypoints[0].pt.x << "," <<features[i].keypoints[0].pt.y);
-			//LOG_MESS(features[i].keypoints[1].pt.x << "," <<features[i].keypoints[1].pt.y);system("pause");
+	if (isFindFeatures || osp.isRealStitching) parallelForEachImage(imgCnt, [&](int i) {
+		//assert(srcs[i].size().width >= resizeSz[i].width && srcs[i].size().height >= resizeSz[i].height);
+		if (isFindFeatures) {
+			Mat full_img;
+			if (srcs[i].size() == sInfo.resizeSz) full_img = srcs[i];
+			else ImageUtil::resize(srcs[i], full_img, sInfo.resizeSz, 0,0);
+			Size workSz = scaledSize(sInfo.resizeSz, work_scale);
+			std::vector<Rect> rois = StitchingUtil::getMaskROI(workSz, i, imgCnt, sInfo.maskRatio);
+			// The finder runs once per strip, so the keypoint cap of the image is shared among strips
+			int stripCnt = 0;
+			for (auto &roi:rois) if (roi.area() > 0) ++stripCnt;
+			int stripMaxKeypoints = osp.maxKeypoints > 0 && stripCnt > 0 ? (osp.maxKeypoints + stripCnt - 1) / stripCnt : osp.maxKeypoints;
+			// Finders keep internal buffers, so each task uses its own
+			Ptr<FeaturesFinder> finder = createFeaturesFinder(osp, stripMaxKeypoints);
+			findStripFeatures(*finder, full_img, work_scale, rois, features[i]);
 			features[i].img_idx = i;
-			LOG_MESS("Features in image #" << i+1 << ": " << features[i].keypoints.size());
-			ImageUtil::resize(full_img, img, Size(), seam_scale, seam_scale);
-			images[i] = img.clone();
 		}
-		
-		
-		finder->collectGarbage();
-		full_img.release();
-		img.release();
+		// Estimation does not warp images at seam scale
+		if (!osp.isRealStitching) return;
+		ImageUtil::resize(srcs[i], images[i], scaledSize(sInfo.resizeSz, seam_scale));
+	});
+
+	if (!isFindFeatures) {
+		sInfoNotNull.setToCamerasInternalParam(cameras);
+		warped_image_scale = sInfoNotNull.getWarpScale();
+
+	} else {
+		for (int i = 0; i < imgCnt; ++i)
+			LOG_MESS("Features in image #" << i+1 << ": " << features[i].keypoints.size());
 
 		LOG_MESS("Pairwise matching ...");
-		BestOf2NearestMatcher matcher(false, osParam.match_conf);
+		BestOf2NearestMatcher matcher(false, osp.match_conf);
 		matcher(features, pairwise_matches); 
 		matcher.collectGarbage();
-		estimator = HomographyBasedEstimator();
-		estimator(features, pairwise_matches, cameras);
 		sInfo.features.assign(features.begin(), features.end());
-	
-	
-		for (size_t i = 0; i < cameras.size(); ++i) {
-			Mat R;
-			cameras[i].R.convertTo(R, CV_32F);
-			cameras[i].R = R;
-			//LOG_MESS("Initial intrinsics #" << i+1 << ":\n" << cameras[i].K());
-			//LOG_MESS("Initial intrinsics R #" << i+1 << ":\n" << cameras[i].R);
-			//LOG_MESS("Initial intrinsics t #" << i+1 << ":\n" << cameras[i].t);
-			//system("pause");
-		}
 
 		Ptr<detail::BundleAdjusterBase> adjuster;
 		adjuster = new detail::BundleAdjusterRay();
 
-		adjuster->setConfThresh(osParam.conf_thresh);
+		adjuster->setConfThresh(osp.conf_thresh);
 		Mat_<uchar> refine_mask = Mat::zeros(3, 3, CV_8U);
 		refine_mask(0,0) = 1;
 		refine_mask(0,1) = 1;
@@ -133,7 +222,35 @@ StitchingInfo StitchingUtil::opencvSelfStitching(
 		refine_mask(1,1) = 1;
 		refine_mask(1,2) = 1;
 		adjuster->setRefinementMask(refine_mask);
-		(*adjuster)(features, pairwise_matches, cameras);
+
+		// A former calibration is nearly correct on a stable rig, so only a few iterations are needed from it
+		bool isWarmStarted = warmCameras.size() == imgCnt;
+		if (isWarmStarted) {
+			cameras = warmCameras;
+			isWarmStarted = warmBundleAdjust(*adjuster, osp, features, pairwise_matches, cameras);
+			if (!isWarmStarted) {
+				LOG_WARN("Warm started bundle adjustment failed, estimating from scratch");
+				cameras.clear();
+			}
+		}
+
+		if (!isWarmStarted) {
+			estimator = HomographyBasedEstimator();
+			estimator(features, pairwise_matches, cameras);
+
+			for (size_t i = 0; i < cameras.size(); ++i) {
+				Mat R;
+				cameras[i].R.convertTo(R, CV_32F);
+				cameras[i].R = R;
+				//LOG_MESS("Initial intrinsics #" << i+1 << ":\n" << cameras[i].K());
+				//LOG_MESS("Initial intrinsics R #" << i+1 << ":\n" << cameras[i].R);
+				//LOG_MESS("Initial intrinsics t #" << i+1 << ":\n" << cameras[i].t);
+				//system("pause");
+			}
+
+			adjuster->setTermCriteria(TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 1000, DBL_EPSILON));
+			(*adjuster)(features, pairwise_matches, cameras);
+		}
 
 	
 		std::vector<double> focals;
@@ -148,7 +265,7 @@ StitchingInfo StitchingUtil::opencvSelfStitching(
 		std::vector<Mat> rmats;
 		for (size_t i = 0; i < cameras.size(); ++i)
 			rmats.push_back(cameras[i].R);
-		waveCorrect(rmats, osParam.wave_correct);
+		waveCorrect(rmats, osp.wave_correct);
 		for (size_t i = 0; i < cameras.size(); ++i)
 			cameras[i].R = rmats[i];
 		
@@ -174,20 +291,17 @@ StitchingInfo StitchingUtil::opencvSelfStitching(
 	std::vector<UMat> masks_warped(imgCnt);
 	std::vector<UMat> images_warped(imgCnt);
 	std::vector<Size> sizes(imgCnt);
-	std::vector<Mat> masks(imgCnt);
-
-	for (int i = 0; i < imgCnt; ++i) {
-		masks[i].create(images[i].size(), CV_8U);
-		masks[i].setTo(Scalar::all(255));
-		//masks[i] = getMask(images[i],i==0);
-	}
 
 	CREATE_WAPPER_POINTER(warper, warped_image_scale*seam_work_aspect);
+	// Maps of estimation candidates are used once, so they never evict those of the calibration in use
+	if (!isFindFeatures) warper->setMapsCache(&warpMapsCache);
 	if (!sInfoNotNull.isNull()) {
 		warper->setProjectorData(sInfoNotNull.projData);
 		warper->setPLTs(sInfoNotNull.pltHelpers);
 	}
 
+	// Projector state depends on the calling sequence, so maps are fetched in order and only remapping runs in parallel
+	std::vector<supp::WarpMapsCache::Entry> seam_maps(imgCnt);
 	for (int i = 0; i < imgCnt; ++i) {
 		Mat_<float> K;
 		cameras[i].K().convertTo(K, CV_32F);
@@ -196,128 +310,349 @@ StitchingInfo StitchingUtil::opencvSelfStitching(
 		K(1,1) *= swa; K(1,2) *= swa;
 
 		warper->setCurrentImageIdx(i);
-		corners[i] = warper->warp(images[i], K, cameras[i].R, INTER_LINEAR, BORDER_REFLECT, images_warped[i]);//Calculate the unite corner
-		sizes[i] = images_warped[i].size();
+		if (!osp.isRealStitching) {
+			// Only ROIs are replayed, for the image and its mask as below, so that resultRois keep their layout
+			Size seam_sz = scaledSize(sInfo.resizeSz, seam_scale);
+			warper->replayRoi(seam_sz, K, cameras[i].R);
+			warper->replayRoi(seam_sz, K, cameras[i].R);
+			continue;
+		}
+		seam_maps[i] = warper->getMaps(images[i].size(), K, cameras[i].R);
+		corners[i] = seam_maps[i].dstRoi.tl();//Calculate the unite corner
+		sizes[i] = seam_maps[i].xmap.size();
 
-		warper->warp(masks[i], K, cameras[i].R, INTER_NEAREST, BORDER_CONSTANT, masks_warped[i]);
+		warper->warpMask(images[i].size(), K, cameras[i].R, masks_warped[i]);
+	}
+	if (osp.isRealStitching) parallelForEachImage(imgCnt, [&](int i) {
+		remap(images[i], images_warped[i], seam_maps[i].xmap, seam_maps[i].ymap, INTER_LINEAR, BORDER_REFLECT);
+	});
+	seam_maps.clear();
+
+	// Estimation pastes warped images as they are, without exposure compensation or seams
+	Ptr<ExposureCompensator> compensator;
+	if (!osp.isRealStitching) {
+		compensator = ExposureCompensator::createDefault(ExposureCompensator::NO);
+	} else if (osp.expos_comp_type == ExposureCompensator::GAIN_BLOCKS) {
+		// Gains are solved only on keyframes, and smoothed in between
+		supp::ReusableBlocksGainCompensator *bgc = new supp::ReusableBlocksGainCompensator();
+		compensator = bgc;
+		StitchingInfo &gainSrc = sInfoNotNull.isNull() ? sInfo : sInfoNotNull;
+		if (gainSrc.gainMapsTarget.size() != imgCnt || ++gainSrc.gainFrameCnt >= EXPOS_COMP_KEYFRAME_INTERVAL) {
+			bgc->feed(corners, images_warped, masks_warped);
+			gainSrc.gainMapsTarget = bgc->getGainMaps();
+			gainSrc.gainFrameCnt = 0;
+		}
+		supp::ReusableBlocksGainCompensator::smoothGainMaps(gainSrc.gainMaps, gainSrc.gainMapsTarget, EXPOS_COMP_SMOOTH_RATIO);
+		bgc->setGainMaps(gainSrc.gainMaps);
+		sInfo.gainMaps = gainSrc.gainMaps;
+		sInfo.gainMapsTarget = gainSrc.gainMapsTarget;
+		sInfo.gainFrameCnt = gainSrc.gainFrameCnt;
+	} else {
+		compensator = ExposureCompensator::createDefault(osp.expos_comp_type);
+		compensator->feed(corners, images_warped, masks_warped);
 	}
 
-	std::vector<UMat> images_warped_f(imgCnt);
-	for (int i = 0; i < imgCnt; ++i)
-		images_warped[i].convertTo(images_warped_f[i], CV_32F);
-
-
-	Ptr<ExposureCompensator> compensator = ExposureCompensator::createDefault(osParam.expos_comp_type);
-	compensator->feed(corners, images_warped, masks_warped);
+	std::vector<Mat> &composeMasks = sInfoNotNull.isNull() ? sInfo.composeMasks : sInfoNotNull.composeMasks;
+	if (!osp.isRealStitching) {
+		// No seams for estimation, warped masks are composed directly
+	} else if (isSeamReusable(sInfoNotNull, images_warped, corners, masks_warped)) {
+		LOG_MESS("Reuse seams of former frames.");
+		for (int i = 0; i < imgCnt; ++i)
+			sInfoNotNull.seamMasks[i].copyTo(masks_warped[i]);
+		sInfo.seamMasks = sInfoNotNull.seamMasks;
+		sInfo.seamCorners = sInfoNotNull.seamCorners;
+		sInfo.seamRefImages = sInfoNotNull.seamRefImages;
+		sInfo.seamPaths = sInfoNotNull.seamPaths;
+	} else if (!osp.isSeamSearch) {
+		// Stale seams are dropped, and overlaps are left to the blender
+		LOG_MESS("Seam search skipped.");
+		if (!sInfoNotNull.isNull() && !sInfoNotNull.seamMasks.empty()) {
+			sInfoNotNull.seamMasks.clear();
+			sInfoNotNull.seamCorners.clear();
+			sInfoNotNull.seamRefImages.clear();
+			sInfoNotNull.seamPaths.clear();
+			composeMasks = std::vector<Mat>(imgCnt);
+		}
+	} else {
+		// Former seams of the same geometry, to follow by the DP seam finder and to measure flicker against
+		bool isSameSeamGeometry = !sInfoNotNull.isNull() && sInfoNotNull.seamCorners == corners;
+		int64 t = getTickCount();
+		if (osp.seamFinderType == SEAM_TEMPORAL_DP) {
+			supp::TemporalDpSeamFinder seam_finder(DP_SEAM_TEMPORAL_PENALTY,
+				isSameSeamGeometry ? sInfoNotNull.seamPaths : supp::SeamPaths());
+			seam_finder.find(images_warped, corners, masks_warped);
+			sInfo.seamPaths = seam_finder.getPaths();
+		} else {
+			std::vector<UMat> images_warped_f(imgCnt);
+			for (int i = 0; i < imgCnt; ++i)
+				images_warped[i].convertTo(images_warped_f[i], CV_32F);
+			detail::GraphCutSeamFinder seam_finder(GraphCutSeamFinderBase::COST_COLOR);
+			seam_finder.find(images_warped_f, corners, masks_warped);
+			sInfo.seamPaths.clear();
+		}
+		if (osp.isSeamStats) {
+			double seamMs = (getTickCount() - t) * 1000.0 / getTickFrequency();
+			addSeamStats(seamMs, supp::seamCost(images_warped, corners, masks_warped),
+				isSameSeamGeometry ? supp::seamFlicker(masks_warped, sInfoNotNull.seamMasks) : -1);
+		}
 
-	Ptr<SeamFinder> seam_finder;
-	seam_finder = new detail::GraphCutSeamFinder(GraphCutSeamFinderBase::COST_COLOR);
-	seam_finder->find(images_warped_f, corners, masks_warped);
+		sInfo.seamMasks = std::vector<UMat>(imgCnt);
+		sInfo.seamRefImages = std::vector<UMat>(imgCnt);
+		for (int i = 0; i < imgCnt; ++i) {
+			sInfo.seamMasks[i] = masks_warped[i].clone();
+			sInfo.seamRefImages[i] = images_warped[i];
+		}
+		sInfo.seamCorners = corners;
+		composeMasks = std::vector<Mat>(imgCnt);
+		// Keep seams with the calibration in use, so that the following frames can reuse them
+		if (!sInfoNotNull.isNull()) {
+			sInfoNotNull.seamMasks = sInfo.seamMasks;
+			sInfoNotNull.seamCorners = sInfo.seamCorners;
+			sInfoNotNull.seamRefImages = sInfo.seamRefImages;
+			sInfoNotNull.seamPaths = sInfo.seamPaths;
+		}
+	}
 
+	if (osp.isRealStitching && composeMasks.size() != imgCnt) composeMasks = std::vector<Mat>(imgCnt);
 	images.clear();
 	images_warped.clear();
-	images_warped_f.clear();
-	masks.clear();
 
 	LOG_MESS("Compositing...");
 
-	Mat img_warped, img_warped_s;
-	Mat dilated_mask, seam_mask, mask, mask_warped;
 	Ptr<Blender> blender;
+	bool isBlenderPersistent = false;
+	float blend_width = 0;
 	
-	double compose_work_aspect = 1;
+	// Maps in source image coordinates, captured once for single-pass compositing
+	bool isCapturePanoMaps = osp.isSinglePassCompose && osp.isRealStitching
+		&& !sInfoNotNull.isNull() && sInfoNotNull.panoMaps.empty();
+	std::vector<Mat> pano_xmaps(imgCnt), pano_ymaps(imgCnt);
+
+	// Cameras were estimated at work scale, so they are rescaled to compose scale once for all images
+	compose_scale = min(1.0, sqrt(osp.composeMegapix * 1e6 / sInfo.resizeSz.area()));
+	double compose_work_aspect = compose_scale / work_scale;
+	warped_image_scale *= static_cast<float>(compose_work_aspect);
+	warper->setScale(warped_image_scale);
+	Size img_size = sInfo.resizeSz;
+	if (abs(compose_scale - 1) > 1e-1)
+		img_size = scaledSize(img_size, compose_scale);
+
+	std::vector<Mat> compose_Ks(imgCnt);
+	for (int i = 0; i < imgCnt; ++i) {
+		cameras[i].focal *= compose_work_aspect;
+		cameras[i].ppx *= compose_work_aspect;
+		cameras[i].ppy *= compose_work_aspect;
+		cameras[i].K().convertTo(compose_Ks[i], CV_32F);
+		warper->setCurrentImageIdx(i);
+		Rect roi = warper->warpRoi(img_size, compose_Ks[i], cameras[i].R);
+		corners[i] = roi.tl();
+		sizes[i] = roi.size();
+	}
 
+	// Buffers of a given calibration are kept across frames, the null one may be shared by concurrent stages
+	std::vector<Mat> localImgBuffs, localWarpedBuffs;
+	std::vector<Mat> &imgs_resized = sInfoNotNull.isNull() ? localImgBuffs : sInfoNotNull.composeImgBuffs;
+	std::vector<Mat> &imgs_warped = sInfoNotNull.isNull() ? localWarpedBuffs : sInfoNotNull.composeWarpedBuffs;
+	imgs_resized.resize(imgCnt);
+	imgs_warped.resize(imgCnt);
+
+	// Geometry is replayed in order as the warper requires, then pixels of all images are processed in parallel
+	std::vector<supp::WarpMapsCache::Entry> compose_maps(imgCnt);
+	std::vector<Mat> masks_compose(imgCnt);
 	for (int img_idx = 0; img_idx < imgCnt; ++img_idx) {
 		LOG_MESS("Compositing image #" << img_idx+1);
-		// reCalculate corner and mask since the former estimation is based on work_scale
-		
-		full_img1 = srcs[img_idx].clone();
-		ImageUtil::resize(full_img1,full_img, sInfo.resizeSz, 0,0);
-		compose_scale = min(1.0, sqrt(osParam.composeMegapix * 1e6 / full_img.size().area()));
-		compose_work_aspect = compose_scale / work_scale;
-		warped_image_scale *= static_cast<float>(compose_work_aspect);
-		//warper = warper_creator->create(warped_image_scale);
-		warper->setScale(warped_image_scale);
-
-		// Update
-		for (int i = 0; i < imgCnt; ++i) {
-			cameras[i].focal *= compose_work_aspect;
-			cameras[i].ppx *= compose_work_aspect;
-			cameras[i].ppy *= compose_work_aspect;
-
+		const Mat &K = compose_Ks[img_idx];
+		warper->setCurrentImageIdx(img_idx);
+		if (isGeometryOnly)
+			warper->replayRoi(img_size, K, cameras[img_idx].R);
+		else
+			compose_maps[img_idx] = warper->getMaps(img_size, K, cameras[img_idx].R);
+		// The geometry-only final stage still maps coverage at compose scale, but without caching the maps
+		warper->warpMask(img_size, K, cameras[img_idx].R, masks_compose[img_idx]);
+		if (isCapturePanoMaps) {
+			double sx = srcs[img_idx].cols * 1.0 / img_size.width, sy = srcs[img_idx].rows * 1.0 / img_size.height;
+			compose_maps[img_idx].xmap.convertTo(pano_xmaps[img_idx], CV_32F, sx, 0.5*sx - 0.5);
+			compose_maps[img_idx].ymap.convertTo(pano_ymaps[img_idx], CV_32F, sy, 0.5*sy - 0.5);
+		}
+	}
 
-			Size sz = full_img_sizes[i];
-			if (std::abs(compose_scale - 1) > 1e-1) {
-				sz.width = round(full_img_sizes[i].width * compose_scale);
-				sz.height = round(full_img_sizes[i].height * compose_scale);
-			}
+	if (!isGeometryOnly) parallelForEachImage(imgCnt, [&](int img_idx) {
+		// Resized to compose scale in one step, or used as it is if it already has the size
+		const Mat *img = &srcs[img_idx];
+		if (srcs[img_idx].size() != img_size) {
+			ImageUtil::resize(srcs[img_idx], imgs_resized[img_idx], img_size);
+			img = &imgs_resized[img_idx];
+		}
+		remap(*img, imgs_warped[img_idx], compose_maps[img_idx].xmap, compose_maps[img_idx].ymap, INTER_LINEAR, BORDER_REFLECT);
+		if (!osp.isRealStitching) return;
+		const Mat &mask_warped = masks_compose[img_idx];
+		compensator->apply(img_idx, corners[img_idx], imgs_warped[img_idx], mask_warped);
+
+		// The same mask Mat is fed while seams are reused, so blenders can keep their weights
+		if (composeMasks[img_idx].size() != mask_warped.size()) {
+			Mat dilated_mask, seam_mask, compose_mask;
+			dilate(masks_warped[img_idx], dilated_mask, Mat());
+			ImageUtil::resize(dilated_mask, seam_mask, mask_warped.size(),0,0);
+			bitwise_and(seam_mask, mask_warped, compose_mask);
+			composeMasks[img_idx] = compose_mask;
+		}
+	});
+	compose_maps.clear();
 
-			Mat K;
-			cameras[i].K().convertTo(K, CV_32F);
-			warper->setCurrentImageIdx(i);
-			Rect roi = warper->warpRoi(sz, K, cameras[i].R);
-			corners[i] = roi.tl();
-			sizes[i] = roi.size();
+	Mat result, result_mask, tmp;
+	if (isGeometryOnly) {
+		// The covered area stands for the panorama, which is all cropping needs
+		Rect dst_roi = resultRoi(corners, sizes);
+		result_mask = Mat::zeros(dst_roi.size(), CV_8U);
+		for (int img_idx = 0; img_idx < imgCnt; ++img_idx) {
+			Rect rc = Rect(corners[img_idx], masks_compose[img_idx].size()) & dst_roi;
+			Mat dstPart = result_mask(rc - dst_roi.tl());
+			bitwise_or(dstPart, masks_compose[img_idx](rc - corners[img_idx]), dstPart);
 		}
-	
-		if (abs(compose_scale - 1) > 1e-1)
-			ImageUtil::resize(full_img, img, Size(), compose_scale, compose_scale);
-		else
-			img = full_img;
-		full_img.release();
-		Size img_size = img.size();
-	
-		Mat K;
-		cameras[img_idx].K().convertTo(K, CV_32F);
-		warper->setCurrentImageIdx(img_idx);
-		warper->warp(img, K, cameras[img_idx].R, INTER_LINEAR, BORDER_REFLECT, img_warped);
-		mask.create(img_size, CV_8U);
-		mask.setTo(Scalar::all(255));
-		warper->warp(mask, K, cameras[img_idx].R, INTER_NEAREST, BORDER_CONSTANT, mask_warped);
-		compensator->apply(img_idx, corners[img_idx], img_warped, mask_warped);
-
-		img_warped.convertTo(img_warped_s, CV_16S);
-		img_warped.release();
-		img.release();
-		mask.release();
-
-		dilate(masks_warped[img_idx], dilated_mask, Mat());
-		ImageUtil::resize(dilated_mask, seam_mask, mask_warped.size(),0,0);
-		mask_warped = seam_mask & mask_warped;
-		if (blender.empty()) {
-			blender = Blender::createDefault(osParam.blend_type, false);
-			Size dst_sz = resultRoi(corners, sizes).size();
-			float blend_width = sqrt(static_cast<float>(dst_sz.area())) * osParam.blend_strength / 100.f;
-			if (!osParam.isRealStitching||blend_width < 1.f) {
-				blender = Blender::createDefault(Blender::NO, false);
-			} else if (osParam.blend_type == Blender::MULTI_BAND) {
-				MultiBandBlender * mb = dynamic_cast<MultiBandBlender*>(static_cast<Blender*>(blender));
-				mb->setNumBands(static_cast<int>(ceil(log(blend_width)/log(2.0)) - 1.0));
-				LOG_MESS("Multi-band blender, number of bands: " << mb->numBands());
-			} else if (osParam.blend_type == Blender::FEATHER) {
+		cvtColor(result_mask, tmp, CV_GRAY2BGR);
+	} else {
+		Size dst_sz = resultRoi(corners, sizes).size();
+		blend_width = sqrt(static_cast<float>(dst_sz.area())) * osp.blend_strength / 100.f;
+		if (!osp.isRealStitching||blend_width < 1.f) {
+			blender = Blender::createDefault(Blender::NO, false);
+		} else if (osp.blend_type == Blender::MULTI_BAND) {
+			int numBands = static_cast<int>(ceil(log(blend_width)/log(2.0)) - 1.0);
+			// Only pooled for a calibration in use, since stages without one may share the same null owner concurrently
+			blender = sInfoNotNull.isNull() ? createPersistentBlender(Blender::MULTI_BAND, numBands)
+				: getPersistentBlender(Blender::MULTI_BAND, resultRoi(corners, sizes), numBands, &sInfoNotNull);
+			isBlenderPersistent = true;
+			LOG_MESS("Multi-band blender, number of bands: " << numBands);
+		} else if (osp.blend_type == supp::BLENDER_PRECOMPUTED_FEATHER) {
+			blender = sInfoNotNull.isNull() ? createPersistentBlender(supp::BLENDER_PRECOMPUTED_FEATHER, 1.f/blend_width)
+				: getPersistentBlender(supp::BLENDER_PRECOMPUTED_FEATHER, resultRoi(corners, sizes), 1.f/blend_width, &sInfoNotNull);
+			isBlenderPersistent = true;
+			LOG_MESS("Precomputed feather blender, sharpness " << 1.f/blend_width);
+		} else {
+			blender = Blender::createDefault(osp.blend_type, false);
+			if (osp.blend_type == Blender::FEATHER) {
 				FeatherBlender *fb = dynamic_cast<FeatherBlender*>(static_cast<Blender*>(blender));
 				fb->setSharpness(1.0/blend_width);
 				LOG_MESS("Feather blender, sharpness " << fb->sharpness());
 			}
-
-			blender->prepare(corners, sizes);
-
 		}
-
-		blender->feed(img_warped_s, mask_warped, corners[img_idx]);
-
+		blender->prepare(corners, sizes);
+
+		// Fed in index order, which keeps the blended result deterministic
+		Mat img_warped_s;
+		for (int img_idx = 0; img_idx < imgCnt; ++img_idx) {
+			// Estimation pastes warped images without seams
+			const Mat &feed_mask = osp.isRealStitching ? composeMasks[img_idx] : masks_compose[img_idx];
+			// Persistent blenders take 8-bit input directly
+			if (!isBlenderPersistent) {
+				imgs_warped[img_idx].convertTo(img_warped_s, CV_16S);
+				blender->feed(img_warped_s, feed_mask, corners[img_idx]);
+			} else {
+				blender->feed(imgs_warped[img_idx], feed_mask, corners[img_idx]);
+			}
+		}
+		blender->blend(result, result_mask);
+		result.convertTo(tmp, CV_8UC3);
 	}
 
+	if (osp.isRealStitching) sInfo.composeMasks = composeMasks;
 	sInfo.projData = (warper)->getProjectorAllData();
 	sInfo.resultRois = (warper)->getResultRoiData();
 	sInfo.setRanges(corners, sizes);
 
-	Mat result, result_mask, tmp;
-	blender->blend(result, result_mask);
-	result.convertTo(tmp, CV_8UC3);
-	removeBlackPixel(tmp, dstImage, sInfo);
+	// The black border only depends on the compose geometry, so it is found once in the coverage of the blended result.
+	// Only cached in a given calibration, and keyed by it, since a copied or adjusted one may keep a stale crop
+	Rect dst_roi = resultRoi(corners, sizes);
+	StitchingInfo::CropCache &cropCache = sInfoNotNull.cropCache;
+	if (!sInfoNotNull.isNull() && cropCache.isFoundIn(dst_roi, sInfo.projData, sInfoNotNull.pltHelpers)) {
+		sInfo.cropRect = cropCache.cropRect;
+		sInfo.nonBlackRatio = cropCache.nonBlackRatio;
+		sInfo.ranges = cropCache.ranges;
+		dstImage = tmp(sInfo.cropRect);
+	} else {
+		Mat coverage, coverageCropped;
+		if (isGeometryOnly) coverage = tmp;
+		else cvtColor(result_mask, coverage, CV_GRAY2BGR);
+		removeBlackPixel(coverage, coverageCropped, sInfo);
+		dstImage = coverageCropped.empty() ? Mat() : tmp(sInfo.cropRect);
+		if (!sInfoNotNull.isNull() && !coverageCropped.empty() && sInfo.nonBlackRatio >= NONBLACK_REMAIN_FLOOR) {
+			cropCache.dstRoi = dst_roi;
+			cropCache.projData = sInfo.projData.clone();
+			cropCache.pltHelpers = sInfoNotNull.pltHelpers;
+			cropCache.cropRect = sInfo.cropRect;
+			cropCache.nonBlackRatio = sInfo.nonBlackRatio;
+			cropCache.ranges = sInfo.ranges;
+		}
+	}
 	LOG_MESS("Size of Pano:" << dstImage.size());
+
+	if (isCapturePanoMaps && sInfo.cropRect.size() == dstImage.size() && dstImage.size().area() > 0) {
+		LOG_MESS("Capture maps for single-pass compositing.");
+		// Gains are frozen until the next exposure keyframe captures again, only block gains can be folded into the maps
+		bool isBlockGains = osp.expos_comp_type == ExposureCompensator::GAIN_BLOCKS;
+		sInfoNotNull.panoMaps.create(pano_xmaps, pano_ymaps, composeMasks, isBlockGains ? sInfo.gainMaps : std::vector<Mat>(), corners,
+			resultRoi(corners, sizes), sInfo.cropRect, 1.f / max(blend_width, 1.f));
+	}
 	
 	if (warper != NULL) delete warper;
 	return sInfo;
 }
+
+bool StitchingUtil::isSeamReusable(
+	const StitchingInfo &sInfo, const std::vector<UMat> &images, const std::vector<Point> &corners, const std::vector<UMat> &masks) {
+	if (sInfo.isNull() || sInfo.seamMasks.size() != images.size() || sInfo.seamCorners != corners)
+		return false;
+	for (int i = 0; i < images.size(); ++i) {
+		if (sInfo.seamMasks[i].size() != masks[i].size()
+			|| sInfo.seamRefImages[i].size() != images[i].size()
+			|| sInfo.seamRefImages[i].type() != images[i].type())
+			return false;
+	}
+	double score = overlapDiffScore(images, sInfo.seamRefImages, corners, masks);
+	if (score > SEAM_REUSE_DIFF_THRESH) {
+		LOG_MESS("Overlapped content changes (score " << score << "), seams need re-finding.");
+		return false;
+	}
+	return true;
+}
+
+double StitchingUtil::overlapDiffScore(
+	const std::vector<UMat> &images, const std::vector<UMat> &refImages, const std::vector<Point> &corners, const std::vector<UMat> &masks) {
+	double ttlScore = 0;
+	int cnt = 0;
+	for (int i = 0; i < images.size(); ++i) {
+		for (int j = 0; j < images.size(); ++j) {
+			if (i == j) continue;
+			Rect overlap = Rect(corners[i], images[i].size()) & Rect(corners[j], images[j].size());
+			if (overlap.area() == 0) continue;
+			Rect local = overlap - corners[i];
+			UMat diff;
+			absdiff(images[i](local), refImages[i](local), diff);
+			Scalar m = mean(diff, masks[i](local));
+			ttlScore += (m[0] + m[1] + m[2]) / images[i].channels();
+			cnt++;
+		}
+	}
+	return cnt > 0 ? ttlScore / cnt : 0.0;
+}
+
+Ptr<Blender> StitchingUtil::createPersistentBlender(int type, float param) {
+	if (type == Blender::MULTI_BAND)
+		return makePtr<supp::PersistentMultiBandBlender>(static_cast<int>(param));
+	else if (type == supp::BLENDER_PRECOMPUTED_FEATHER)
+		return makePtr<supp::PrecomputedFeatherBlender>(param);
+	CV_Error(Error::StsBadArg, "unsupported persistent blending method");
+	return Ptr<Blender>();
+}
+
+Ptr<Blender> StitchingUtil::getPersistentBlender(int type, Rect dst_roi, float param, const void *owner) {
+	cv::AutoLock lock(blenderPoolMtx);
+	for (auto &item:blenderPool) {
+		if (item.type == type && item.dstRoi == dst_roi && item.param == param && item.owner == owner) return item.blender;
+	}
+	BlenderPoolItem item;
+	item.type = type, item.dstRoi = dst_roi, item.param = param, item.owner = owner;
+	item.blender = createPersistentBlender(type, param);
+	blenderPool.push_back(item);
+	if (blenderPool.size() > BLENDER_POOL_MAX_SIZE) blenderPool.pop_front();
+	return item.blender;
+}